@@ -0,0 +1,205 @@
+#ifndef __ADAPTIVEMC_H_INCLUDED__
+#define __ADAPTIVEMC_H_INCLUDED__
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+/**
+AdaptiveMC runs a simulation in batches and stops as soon as the
+estimate is precise enough, the simulation budget is used up or the
+wall clock budget has passed.  The mean is tracked with running moments
+and its standard error is the usual sigma/sqrt(n).  VaR and expected
+shortfall of the upper tail use sectioning: the draws are split into
+numSections equal sections, the metric is computed on each and the
+spread of the section estimates around the estimate from every draw
+gives a t confidence interval.
+*/
+template<typename T>
+class AdaptiveMC{
+private:
+    int batchSize;
+    int maxSimulations;
+    double timeBudget;
+    int numSimulations;
+    T estimate;
+    T variance;
+    T standardError;
+    T halfWidth;
+    bool isConverged;
+    /**
+    97.5% quantile of the t distribution
+    */
+    static double tQuantile(int degreesOfFreedom){
+        const double quantiles[]={12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+        return degreesOfFreedom<=30?quantiles[degreesOfFreedom-1]:1.96;
+    }
+    static T valueAtRisk(std::vector<T>& draws, double q){
+        const int index=std::min((int)(q*draws.size()), (int)draws.size()-1);
+        std::nth_element(draws.begin(), draws.begin()+index, draws.end());
+        return draws[index];
+    }
+    static T expectedShortfall(std::vector<T>& draws, double q){
+        const int index=std::min((int)(q*draws.size()), (int)draws.size()-1);
+        std::nth_element(draws.begin(), draws.begin()+index, draws.end());
+        T sum=0;
+        for(int i=index; i<(int)draws.size(); ++i){
+            sum+=draws[i];
+        }
+        return sum/(draws.size()-index);
+    }
+    template<typename FN, typename Metric>
+    void simulateSectioned(FN&& fn, const Metric& metric, double q, T targetHalfWidth, int numSections){
+        if(numSections<2||numSections>maxSimulations){
+            throw std::invalid_argument("numSections must be at least 2 and at most maxSimulations");
+        }
+        if(!(q>0&&q<1)){
+            throw std::invalid_argument("q must be in (0, 1)");
+        }
+        const double minTailDrawsPerSection=10;//so the section estimates are not dominated by a handful of draws
+        const double minDraws=minTailDrawsPerSection*numSections/(1-q);
+        const auto start=std::chrono::steady_clock::now();
+        std::vector<T> draws;
+        std::vector<T> section;
+        reset();
+        while(numSimulations<maxSimulations){
+            const int batch=std::min(std::max(batchSize, numSimulations/10), maxSimulations-numSimulations);//checks re-sort every draw, so batches grow with the run
+            for(int i=0; i<batch; ++i){
+                draws.emplace_back(fn());
+            }
+            numSimulations+=batch;
+            if((int)draws.size()<numSections){//every section needs a draw
+                continue;
+            }
+            std::vector<T> all(draws);
+            estimate=metric(all);
+            T sumSquares=0;
+            for(int j=0; j<numSections; ++j){
+                section.assign(draws.begin()+(long long)draws.size()*j/numSections, draws.begin()+(long long)draws.size()*(j+1)/numSections);
+                const T difference=metric(section)-estimate;
+                sumSquares+=difference*difference;
+            }
+            standardError=sqrt(sumSquares/(numSections*(numSections-1.0)));
+            halfWidth=tQuantile(numSections-1)*standardError;
+            if(halfWidth<=targetHalfWidth&&draws.size()>=minDraws){
+                isConverged=true;
+                break;
+            }
+            if(isOutOfTime(start)){
+                break;
+            }
+        }
+    }
+    bool isOutOfTime(std::chrono::steady_clock::time_point start) const{
+        return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()>=timeBudget;
+    }
+    void reset(){
+        numSimulations=0;
+        estimate=0;
+        variance=0;
+        standardError=0;
+        halfWidth=0;
+        isConverged=false;
+    }
+public:
+    /**
+    @param batchSize_ Number of draws between checks of the stopping rule; 
+    for VaR and expected shortfall this grows to a tenth of the draws so far
+    @param maxSimulations_ Largest number of draws
+    @param timeBudget_ Wall clock budget in seconds
+    @throws std::invalid_argument if batchSize_ or maxSimulations_ is not positive
+    */
+    AdaptiveMC(int batchSize_, int maxSimulations_, double timeBudget_):batchSize(batchSize_), maxSimulations(maxSimulations_), timeBudget(timeBudget_){
+        if(batchSize<=0||maxSimulations<=0){
+            throw std::invalid_argument("batchSize and maxSimulations must be positive");
+        }
+        reset();
+    }
+    /**
+    Estimates the mean, stopping once its standard error is below target.
+    @param fn Function returning one draw
+    @param targetStandardError The standard error to reach
+    */
+    template<typename FN>
+    void simulateMean(FN&& fn, T targetStandardError){
+        const auto start=std::chrono::steady_clock::now();
+        reset();
+        T sumSquaredDeviations=0;
+        while(numSimulations<maxSimulations){
+            const int batch=std::min(batchSize, maxSimulations-numSimulations);
+            for(int i=0; i<batch; ++i){
+                const T draw=fn();
+                ++numSimulations;
+                const T delta=draw-estimate;
+                estimate+=delta/numSimulations;
+                sumSquaredDeviations+=delta*(draw-estimate);
+            }
+            variance=numSimulations>1?sumSquaredDeviations/(numSimulations-1):0;
+            standardError=sqrt(variance/numSimulations);
+            halfWidth=1.96*standardError;
+            if(numSimulations>1&&standardError<=targetStandardError){
+                isConverged=true;
+                break;
+            }
+            if(isOutOfTime(start)){
+                break;
+            }
+        }
+    }
+    /**
+    Estimates the VaR of the upper tail, stopping once the half width of
+    its 95% confidence interval is below target.
+    @param fn Function returning one draw
+    @param q The confidence level of VaR (eg, .99)
+    @param targetHalfWidth The confidence interval half width to reach
+    @param numSections Number of sections used for the confidence interval;
+    at least 2 and at most the largest number of draws
+    @throws std::invalid_argument if q or numSections is out of range
+    */
+    template<typename FN>
+    void simulateVaR(FN&& fn, double q, T targetHalfWidth, int numSections=10){
+        simulateSectioned(fn, [&](std::vector<T>& draws){return valueAtRisk(draws, q);}, q, targetHalfWidth, numSections);
+    }
+    /**
+    Estimates the expected shortfall of the upper tail, stopping once the
+    half width of its 95% confidence interval is below target.
+    @param fn Function returning one draw
+    @param q The confidence level (eg, .99)
+    @param targetHalfWidth The confidence interval half width to reach
+    @param numSections Number of sections used for the confidence interval;
+    at least 2 and at most the largest number of draws
+    @throws std::invalid_argument if q or numSections is out of range
+    */
+    template<typename FN>
+    void simulateEShortfall(FN&& fn, double q, T targetHalfWidth, int numSections=10){
+        simulateSectioned(fn, [&](std::vector<T>& draws){return expectedShortfall(draws, q);}, q, targetHalfWidth, numSections);
+    }
+    T getEstimate() const{
+        return estimate;
+    }
+    /**
+    @return The sample variance of the draws; only set by simulateMean
+    */
+    T getVariance() const{
+        return variance;
+    }
+    T getStandardError() const{
+        return standardError;
+    }
+    /**
+    @return Half width of the 95% confidence interval of the estimate
+    */
+    T getHalfWidth() const{
+        return halfWidth;
+    }
+    int getNumSimulations() const{
+        return numSimulations;
+    }
+    /**
+    @return Whether the target was reached before either budget ran out
+    */
+    bool getIsConverged() const{
+        return isConverged;
+    }
+};
+#endif
\ No newline at end of file
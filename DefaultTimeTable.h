@@ -0,0 +1,235 @@
+#ifndef __DEFAULTTIMETABLE_H_INCLUDED__
+#define __DEFAULTTIMETABLE_H_INCLUDED__
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include "SHazard.h"
+/**
+DefaultTimeTable tabulates the inverse of the conditional default time
+distribution on a (total offset, current time, uniform) grid so that
+simulating a default time is a table lookup instead of a root find.
+The total offset is the linear predictor plus log(frailty), so the
+table covers every risk bucket and every frailty draw inside its range.
+The table stores log(1+time to default), which measures error in
+absolute terms for short times and relative terms for long times.
+It is laid out on a grid which is linear in the offset, in log(1+current
+time) and in log(-log(1-uniform)) and is interpolated linearly, which
+keeps the simulated time monotone in the uniform.  Draws outside the grid fall back to
+shazard::simulatedTimeToDefaultInverse, as do draws in a cell with a 
+node at which the loan never defaults, since interpolating towards that 
+sentinel time would give meaningless times.
+*/
+template<int Model, typename S>
+class DefaultTimeTable{
+private:
+    S spline;
+    double offsetMin;
+    double offsetMax;
+    double currentMax;
+    double unifScaleMin;
+    double unifScaleMax;
+    double tolerance;
+    int maxPointsPerDimension;
+    int numOffset;
+    int numCurrent;
+    int numUnif;
+    double maxError;
+    std::vector<double> table;//log(1+time to default), indexed [offset][current][unif]; NaN where the loan never defaults
+    static constexpr double maxTime=100000.0;//same as shazard::simulatedTimeToDefaultInverse
+    static constexpr double largeTimeRemaining=100000.0;
+    static double unifScale(double unif){
+        return log(-log1p(-unif));
+    }
+    static double currentScale(double currentTime){
+        return log1p(currentTime);
+    }
+    double exactLogTime(double totalOffset, double currentTime, double unifScaled) const{
+        return log1p(shazard::simulatedTimeToDefaultInverse<Model>(currentTime, largeTimeRemaining, totalOffset, spline, 1.0, -expm1(-exp(unifScaled))));
+    }
+    /**
+    log(1+time to default) at a node, or NaN if the loan never defaults
+    */
+    double nodeLogTime(double totalOffset, double currentTime, double unifScaled) const{
+        const double logTime=exactLogTime(totalOffset, currentTime, unifScaled);
+        return logTime<log1p(maxTime)?logTime:std::numeric_limits<double>::quiet_NaN();
+    }
+    double offsetAt(double i) const{
+        return offsetMin+(offsetMax-offsetMin)*i/(numOffset-1);
+    }
+    double currentAt(double j) const{
+        return expm1(currentScale(currentMax)*j/(numCurrent-1));
+    }
+    double unifScaleAt(double k) const{
+        return unifScaleMin+(unifScaleMax-unifScaleMin)*k/(numUnif-1);
+    }
+    /**
+    Fills the table.  Each dimension has either as many points as the 
+    coarse table or twice as many intervals, and the nodes shared with 
+    the coarse table are copied rather than found again.
+    @param coarse The previous table, or empty
+    @param coarseOffset The number of offsets in the previous table
+    @param coarseCurrent The number of current times in the previous table
+    @param coarseUnif The number of uniforms in the previous table
+    */
+    void build(const std::vector<double>& coarse, int coarseOffset, int coarseCurrent, int coarseUnif){
+        table.resize(numOffset*numCurrent*numUnif);
+        const int ri=(numOffset-1)/(coarseOffset-1);
+        const int rj=(numCurrent-1)/(coarseCurrent-1);
+        const int rk=(numUnif-1)/(coarseUnif-1);
+        for(int i=0; i<numOffset; ++i){
+            for(int j=0; j<numCurrent; ++j){
+                for(int k=0; k<numUnif; ++k){
+                    double& node=table[(i*numCurrent+j)*numUnif+k];
+                    if(!coarse.empty()&&i%ri==0&&j%rj==0&&k%rk==0){
+                        node=coarse[((i/ri)*coarseCurrent+j/rj)*coarseUnif+k/rk];
+                    }
+                    else{
+                        node=nodeLogTime(offsetAt(i), currentAt(j), unifScaleAt(k));
+                    }
+                }
+            }
+        }
+    }
+    double interpolate(double i, double j, double k) const{
+        const int i0=std::min((int)i, numOffset-2);
+        const int j0=std::min((int)j, numCurrent-2);
+        const int k0=std::min((int)k, numUnif-2);
+        const double wi=i-i0;
+        const double wj=j-j0;
+        const double wk=k-k0;
+        auto at=[&](int di, int dj){
+            const double* row=&table[((i0+di)*numCurrent+j0+dj)*numUnif+k0];
+            return row[0]+wk*(row[1]-row[0]);
+        };
+        return (1-wi)*((1-wj)*at(0, 0)+wj*at(0, 1))+wi*((1-wj)*at(1, 0)+wj*at(1, 1));
+    }
+    /**
+    Error in log(1+time to default) half way between the nodes along 
+    the dimensions whose step is .5, holding the others at the nodes.  
+    Cells with a NaN node are skipped, since simulate does not use them.
+    */
+    double sampleError(double di, double dj, double dk) const{
+        double error=0;
+        for(int i=0; i<numOffset-(di>0); ++i){
+            for(int j=0; j<numCurrent-(dj>0); ++j){
+                for(int k=0; k<numUnif-(dk>0); ++k){
+                    const double approx=interpolate(i+di, j+dj, k+dk);
+                    if(!std::isnan(approx)){
+                        error=std::max(error, std::abs(approx-exactLogTime(offsetAt(i+di), currentAt(j+dj), unifScaleAt(k+dk))));
+                    }
+                }
+            }
+        }
+        return error;
+    }
+public:
+    /**
+    Builds the table, doubling the resolution of each dimension until
+    the error is below the tolerance.  The error is sampled at the 
+    midpoint of every cell edge, the center of every cell face and the 
+    center of every cell, which is where linear interpolation of a 
+    smooth function is usually worst.  It is an estimate from these 
+    samples rather than a bound on the error at every point.  Throws 
+    std::runtime_error if a dimension needs more than 
+    maxPointsPerDimension points to meet the tolerance.  The default 
+    bounds the table at 129^3 entries (17 MB).
+    @param spline_ The compiled spline of the model
+    @param offsetMin_ Smallest total offset (linear predictor plus log frailty) in the table
+    @param offsetMax_ Largest total offset in the table
+    @param currentMax_ Largest time on books in the table
+    @param unifMin Smallest uniform in the table
+    @param unifMax Largest uniform in the table; this only needs to cover
+    the largest PD over the remaining life of any loan
+    @param tolerance_ Target for the sampled error in log(1+simulated time 
+    to default), ie the absolute error for short times and the relative 
+    error for long times
+    @param maxPointsPerDimension_ Bound on the grid size in each dimension
+    */
+    DefaultTimeTable(const S& spline_, double offsetMin_, double offsetMax_, double currentMax_, double unifMin, double unifMax, double tolerance_, int maxPointsPerDimension_=129):
+        spline(spline_), offsetMin(offsetMin_), offsetMax(offsetMax_), currentMax(currentMax_), unifScaleMin(unifScale(unifMin)), unifScaleMax(unifScale(unifMax)), tolerance(tolerance_), maxPointsPerDimension(maxPointsPerDimension_){
+        numOffset=9;
+        numCurrent=9;
+        numUnif=17;
+        build(std::vector<double>(), numOffset, numCurrent, numUnif);
+        bool isRefined=true;
+        while(isRefined){
+            isRefined=false;
+            maxError=0;
+            double errors[8];//indexed by a bit mask of the dimensions sampled between the nodes
+            for(int mask=1; mask<8; ++mask){
+                errors[mask]=sampleError(mask&1?.5:0, mask&2?.5:0, mask&4?.5:0);
+                maxError=std::max(maxError, errors[mask]);
+            }
+            bool isTooCoarse[]={errors[1]>tolerance, errors[2]>tolerance, errors[4]>tolerance};
+            if(!(isTooCoarse[0]||isTooCoarse[1]||isTooCoarse[2])){//only face or cell centers miss, so refine the dimensions they lie between
+                for(int mask=1; mask<8; ++mask){
+                    for(int dimension=0; dimension<3; ++dimension){
+                        isTooCoarse[dimension]=isTooCoarse[dimension]||(errors[mask]>tolerance&&(mask>>dimension&1));
+                    }
+                }
+            }
+            int* numPoints[]={&numOffset, &numCurrent, &numUnif};
+            const int coarseOffset=numOffset, coarseCurrent=numCurrent, coarseUnif=numUnif;
+            for(int dimension=0; dimension<3; ++dimension){
+                if(isTooCoarse[dimension]&&*numPoints[dimension]*2-1<=maxPointsPerDimension){
+                    *numPoints[dimension]=*numPoints[dimension]*2-1;
+                    isRefined=true;
+                }
+            }
+            if(isRefined){
+                const std::vector<double> coarse(std::move(table));
+                build(coarse, coarseOffset, coarseCurrent, coarseUnif);
+            }
+        }
+        if(maxError>tolerance){
+            throw std::runtime_error("DefaultTimeTable: the tolerance needs more than maxPointsPerDimension points in a dimension");
+        }
+    }
+    /**
+    Simulates the time to default for a loan.
+    @param timeOnBooks The time the loan has been on the books
+    @param timeRemaining The time until the loan matures
+    @param offset The linear predictor of the loan
+    @param frailty A positive random variable which jointly impacts losses
+    @param unif A uniform random variable
+    @return Time after timeOnBooks at which the loan defaults, or a
+    very large time if it does not default before maturity
+    */
+    double simulate(double timeOnBooks, double timeRemaining, double offset, double frailty, double unif) const{
+        const double totalOffset=offset+log(frailty);
+        const double unifScaled=unifScale(unif);
+        if(totalOffset<offsetMin||totalOffset>offsetMax||timeOnBooks>currentMax||unifScaled<unifScaleMin||unifScaled>unifScaleMax){
+            return shazard::simulatedTimeToDefaultInverse<Model>(timeOnBooks, timeRemaining, offset, spline, frailty, unif);
+        }
+        const double logTime=interpolate(
+            (totalOffset-offsetMin)/(offsetMax-offsetMin)*(numOffset-1),
+            currentScale(timeOnBooks)/currentScale(currentMax)*(numCurrent-1),
+            (unifScaled-unifScaleMin)/(unifScaleMax-unifScaleMin)*(numUnif-1)
+        );
+        if(std::isnan(logTime)){
+            return shazard::simulatedTimeToDefaultInverse<Model>(timeOnBooks, timeRemaining, offset, spline, frailty, unif);
+        }
+        const double timeToDefault=expm1(logTime);
+        return timeToDefault>timeRemaining?maxTime:timeToDefault;
+    }
+    /**
+    @return The largest error in log(1+time to default) found at the 
+    edge, face and cell centers
+    */
+    double getMaxError() const{
+        return maxError;
+    }
+    /**
+    @return The number of entries in the table
+    */
+    int size() const{
+        return table.size();
+    }
+};
+template<int Model, typename S>
+constexpr double DefaultTimeTable<Model, S>::maxTime;
+template<int Model, typename S>
+constexpr double DefaultTimeTable<Model, S>::largeTimeRemaining;
+#endif
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include "matrix.h"
 #include <vector>
 #include <unordered_map>
+#include <string>
+#include <cmath>
+#include <stdexcept>
 /**
 Generates exposure give default from a parameteric model.  
 This model is described in LGDDocumentation.pdf. 
@@ -34,13 +37,29 @@ private:
         return amountDrawnDown(t, APR, originalBalance, 72, 12);
     }
 
-    double collFunction(double offset, double collateralValue, double t){
-        double tDiff=exp(-(t-idiosynracticParameters["tau"])*idiosynracticParameters["gamma"]);
-        return collateralValue*exp((offset+idiosynracticParameters["Scalar3"])*t+idiosynracticParameters["Scalar1"])-idiosynracticParameters["Scalar2"]*tDiff/(1+tDiff);
+    double collFunction(double offset, double collateralValue, double t) const{
+        double tDiff=exp(-(t-tau)*coefT);
+        return collateralValue*exp((offset+interceptT)*t+intercept)-interceptL*tDiff/(1+tDiff);
+    }
+    /**
+    Copies idiosynracticParameters into plain members so that predict 
+    can run concurrently without touching the map
+    */
+    void readParameters(){
+        intercept=idiosynracticParameters.at("Scalar1");
+        interceptL=idiosynracticParameters.at("Scalar2");
+        interceptT=idiosynracticParameters.at("Scalar3");
+        coefT=idiosynracticParameters.at("gamma");
+        tau=idiosynracticParameters.at("tau");
     }
 public:
     EGD(){
+        readParameters();
     }
+    /**
+    The parameters of the LGD model.  Changes take effect at the next 
+    call to init, or immediately through setParameter.
+    */
     std::unordered_map<std::string, double> idiosynracticParameters={
         {"Scalar1", 0},
         {"Scalar2", 0},
@@ -49,6 +68,18 @@ public:
         {"Scalar3", 0}
     };
     /**
+    Sets a parameter of the LGD model.  Takes effect immediately, 
+    without another call to init, but must not be called while 
+    predict is running.
+    @param name One of Scalar1, Scalar2, Scalar3, tau and gamma
+    @param value The value of the parameter
+    @throws std::out_of_range if name is not a parameter
+    */
+    void setParameter(const std::string& name, double value){
+        idiosynracticParameters.at(name)=value;
+        readParameters();
+    }
+    /**
     Clears all vectors; resets class to initial state
     */
     void reset_all(){
@@ -57,15 +88,24 @@ public:
         offsets.clear();
     }
     /**
-    Run after inserting data into this class.  
+    Run after inserting data into this class and after any change to 
+    idiosynracticParameters, which are copied here so that predict only 
+    reads plain members.  
     */
     void init(){
+        readParameters();
         int numAdditionalParameters=3;
         attributes.setM(coefficients.size()+numAdditionalParameters);
         offsets=std::vector<double>(attributes.getN(), 0.0);
         if(attributes.getN()==0){
             throw 0;
         }
+        int m=coefficients.size();
+        for(int i=0; i<(int)offsets.size(); ++i){
+            for(int j=0; j<m; ++j){
+                offsets[i]+=coefficients[j]*attributes.get(i, j);
+            }
+        }
     }
     /**
     @param coeff A parameter value estimated from the model.
@@ -143,13 +183,7 @@ public:
     @return Estimate of loss given default
     */
     double predict(int i, double stdNorm, double t){
-        int m=coefficients.size();
-        if(offsets[i]==0){
-            int j=0;
-            for(int j=0; j<m; ++j){
-                offsets[i]+=coefficients[j]*attributes.get(i, j);
-            }
-        }
+        int m=coefficients.size();//offsets are computed in init and parameters read in init or setParameter so that predict can run concurrently
         //APR index=m
         //originalBalance index=m+1
         //collateralValue index=m+2
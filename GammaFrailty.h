@@ -0,0 +1,116 @@
+#ifndef __GAMMAFRAILTY_H_INCLUDED__
+#define __GAMMAFRAILTY_H_INCLUDED__
+#include <random>
+#include <vector>
+#include <cmath>
+#include "VMath.h"
+/**
+GammaFrailty draws a gamma frailty with mean one.  For importance
+sampling the draws can come from the exponentially tilted density
+exp(tilt*x)f(x)/M(tilt), which is again gamma with a larger mean and
+so puts more scenarios in the tail of the loss distribution.  The
+likelihood ratio f(x)/g(x)=M(tilt)exp(-tilt*x) of each draw is kept,
+in order, so it can be passed to the weighted RiskContribution
+metrics alongside the simulated losses.  A tilt of zero is plain
+Monte Carlo with every weight equal to one.  The gamma draws use
+Marsaglia and Tsang's method on uniforms built from the bits of the
+generator, with the transcendental functions from VMath, rather than
+std::gamma_distribution, whose algorithm differs between standard
+libraries.  Every multiply followed by an add is an explicit std::fma, 
+as in VMath, so a seed gives the same frailties and weights bit for 
+bit on every platform and compiler, whatever floating point 
+contractions are enabled.
+*/
+class GammaFrailty{
+private:
+    std::mt19937_64 generator;
+    double variance;
+    double tilt;
+    double logMgf;
+    double shape;
+    double scale;
+    double spareNorm;
+    bool hasSpareNorm;
+    std::vector<double> weights;
+    double getUnif(){
+        return ((generator()>>11)+.5)*(1.0/9007199254740992.0);
+    }
+    /**
+    Box-Muller, keeping the second normal for the next call
+    */
+    double getNorm(){
+        if(hasSpareNorm){
+            hasSpareNorm=false;
+            return spareNorm;
+        }
+        const double r=sqrt(-2.0*vmath::log(getUnif()));
+        double s, c;
+        vmath::sinCos2Pi(getUnif(), s, c);
+        spareNorm=r*s;
+        hasSpareNorm=true;
+        return r*c;
+    }
+    /**
+    Marsaglia and Tsang (2000).  Shapes below one draw with shape+1
+    and multiply by U^(1/shape).
+    @return A gamma draw with unit scale
+    */
+    double getGamma(){
+        const double a=shape<1?shape+1:shape;
+        const double d=a-1.0/3.0;
+        const double c=1.0/sqrt(9.0*d);
+        double draw;
+        while(true){
+            double x, v;
+            do{
+                x=getNorm();
+                v=std::fma(c, x, 1.0);
+            }while(v<=0);
+            v=v*v*v;
+            const double u=getUnif();
+            if(u<std::fma(-.0331*x*x*x, x, 1.0)||vmath::log(u)<std::fma(.5*x, x, d*(1.0-v+vmath::log(v)))){
+                draw=d*v;
+                break;
+            }
+        }
+        return shape<1?draw*vmath::exp(vmath::log(getUnif())/shape):draw;
+    }
+public:
+    /**
+    @param variance_ The variance of the frailty
+    @param tilt_ The exponential tilt; must be less than 1/variance_
+    @param seed The seed of the generator
+    */
+    GammaFrailty(double variance_, double tilt_, int seed):generator(seed), variance(variance_), tilt(tilt_), logMgf(-vmath::log(std::fma(-tilt_, variance_, 1.0))/variance_), shape(1.0/variance_), scale(variance_/std::fma(-tilt_, variance_, 1.0)), spareNorm(0), hasSpareNorm(false){
+    }
+    /**
+    @param variance The variance of the frailty
+    @param mean The mean of the frailty under the sampling density
+    @return The tilt which moves the mean of the frailty to mean
+    */
+    static double tiltForMean(double variance, double mean){
+        return (1.0-1.0/mean)/variance;
+    }
+    /**
+    @return A frailty draw; its likelihood ratio is appended to the weights
+    */
+    double simulate(){
+        const double frailty=getGamma()*scale;
+        weights.emplace_back(vmath::exp(std::fma(-tilt, frailty, logMgf)));
+        return frailty;
+    }
+    /**
+    @param u The argument
+    @return The Laplace transform of the (untilted) frailty
+    */
+    double laplace(double u) const{
+        return pow(1.0+variance*u, -1.0/variance);
+    }
+    /**
+    @return The likelihood ratio of every draw so far, in order
+    */
+    const std::vector<double>& getWeights() const{
+        return weights;
+    }
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,227 @@
+#ifndef __LOSSDISTRIBUTION_H_INCLUDED__
+#define __LOSSDISTRIBUTION_H_INCLUDED__
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "SHazard.h"
+/**
+LossDistribution computes the portfolio loss distribution without
+simulating default times.  Given the frailty, defaults are independent,
+so the conditional distribution of the loss on a lattice of lossUnit
+steps is built by recursive convolution, adding one loan at a time.
+A severity between two lattice points is split between them so that
+the expected loss is exact.  The conditional distributions are then
+averaged over the frailty with quadrature.  Each frailty node is an
+independent task on the work stealing pool.  The lattice is capped at
+maxPoints points; the probability of a loss beyond it, and the expected
+loss on that event, are carried as a tail mass, so the cost is
+O(nodes*loans*maxPoints) however large the book.  lossUnit should be
+chosen so that the quantiles of interest lie below maxPoints*lossUnit.
+*/
+template<int Model, typename S>
+class LossDistribution{
+private:
+    double lossUnit;
+    std::vector<double> probabilities;//probability of a loss of k*lossUnit
+    double tailProbability;//probability of a loss of at least probabilities.size()*lossUnit
+    double tailLoss;//expected loss, in lattice units, on that event
+    /**
+    Adds one loan to a conditional distribution whose support is
+    [0, maxIndex], moving mass that passes the end of the lattice into
+    the tail.  Given the tail, the loan adds pd times its severity to
+    the expected loss, so tailLoss stays exact.
+    */
+    static void addLoan(std::vector<double>& distribution, int maxIndex, double pd, int lower, double upperWeight, double& tail, double& tailLoss){
+        const int numPoints=distribution.size();
+        const double survive=1.0-pd;
+        const double lowerProbability=pd*(1.0-upperWeight);
+        const double upperProbability=pd*upperWeight;
+        tailLoss+=tail*pd*(lower+upperWeight);
+        for(int j=std::max(numPoints-lower-1, 0); j<=maxIndex; ++j){
+            if(j+lower>=numPoints){
+                tail+=lowerProbability*distribution[j];
+                tailLoss+=lowerProbability*distribution[j]*(j+lower);
+            }
+            tail+=upperProbability*distribution[j];
+            tailLoss+=upperProbability*distribution[j]*(j+lower+1);
+        }
+        for(int k=std::min(maxIndex+lower+1, numPoints-1); k>=0; --k){
+            double value=survive*(k<=maxIndex?distribution[k]:0.0);
+            if(k>=lower&&k-lower<=maxIndex){
+                value+=lowerProbability*distribution[k-lower];
+            }
+            if(k>lower&&k-lower-1<=maxIndex){
+                value+=upperProbability*distribution[k-lower-1];
+            }
+            distribution[k]=value;
+        }
+    }
+public:
+    /**
+    @param portfolio The loans
+    @param spline The compiled spline of the model
+    @param horizon Time after today over which losses are measured; loans
+    maturing sooner are only exposed until maturity
+    @param severities The dollar loss given default of each loan, eg from
+    EGD::predict or LGD::predict; negative severities count as zero
+    @param lossUnit_ The spacing of the loss lattice
+    @param frailtyNodes The quadrature nodes of the frailty
+    @param frailtyWeights The quadrature weights of the frailty, summing to one
+    @param maxPoints The largest number of lattice points
+    @param pool The pool to run on
+    */
+    LossDistribution(const Portfolio& portfolio, const S& spline, double horizon, const std::vector<double>& severities, double lossUnit_, const std::vector<double>& frailtyNodes, const std::vector<double>& frailtyWeights, int maxPoints=4096, WorkStealingPool& pool=defaultPool()):lossUnit(lossUnit_), tailProbability(0), tailLoss(0){
+        const int numLoans=portfolio.size();
+        const int numNodes=frailtyNodes.size();
+        const auto linearPredictors=portfolio.linearPredictors();
+        std::vector<int> lowers(numLoans);
+        std::vector<double> upperWeights(numLoans);
+        int numPoints=1;
+        for(int i=0; i<numLoans; ++i){
+            const double units=std::max(severities[i], 0.0)/lossUnit;
+            lowers[i]=(int)units;
+            upperWeights[i]=units-lowers[i];
+            numPoints=std::min(numPoints+lowers[i]+1, maxPoints);
+        }
+        std::vector<std::vector<double> > conditional(numNodes);
+        std::vector<double> conditionalTail(numNodes, 0.0);
+        std::vector<double> conditionalTailLoss(numNodes, 0.0);
+        pool.parallelFor(numNodes, [&](int node){
+            std::vector<double>& distribution=conditional[node];
+            distribution.assign(numPoints, 0.0);
+            distribution[0]=1.0;
+            int maxIndex=0;
+            for(int i=0; i<numLoans; ++i){
+                const shazard::PreparedLoan loan=shazard::prepareLoan(portfolio, i, linearPredictors);
+                const double pd=shazard::makeConditionalSurvival<Model>(spline, loan, frailtyNodes[node]).PD(loan.timeOnBooks+std::min(horizon, loan.timeRemaining));
+                addLoan(distribution, maxIndex, pd, lowers[i], upperWeights[i], conditionalTail[node], conditionalTailLoss[node]);
+                maxIndex=std::min(maxIndex+lowers[i]+1, numPoints-1);
+            }
+        });
+        probabilities.assign(numPoints, 0.0);
+        for(int node=0; node<numNodes; ++node){
+            for(int k=0; k<numPoints; ++k){
+                probabilities[k]+=frailtyWeights[node]*conditional[node][k];
+            }
+            tailProbability+=frailtyWeights[node]*conditionalTail[node];
+            tailLoss+=frailtyWeights[node]*conditionalTailLoss[node];
+        }
+        while(tailProbability==0&&probabilities.size()>1&&probabilities.back()==0){
+            probabilities.pop_back();
+        }
+    }
+    /**
+    Generalized Gauss-Laguerre quadrature for a gamma frailty with mean one
+    (Numerical Recipes gaulag).
+    @param variance The variance of the frailty
+    @param numNodes The number of nodes
+    @param nodes Filled with the frailty nodes
+    @param weights Filled with the weights, which sum to one
+    */
+    static void gammaQuadrature(double variance, int numNodes, std::vector<double>& nodes, std::vector<double>& weights){
+        const double shape=1.0/variance;
+        const double alpha=shape-1.0;
+        const double accuracy=1e-14;
+        const int maxIterations=100;
+        std::vector<double> x(numNodes);
+        nodes.resize(numNodes);
+        weights.resize(numNodes);
+        double z=0;
+        for(int i=0; i<numNodes; ++i){
+            if(i==0){
+                z=(1.0+alpha)*(3.0+.92*alpha)/(1.0+2.4*numNodes+1.8*alpha);
+            }
+            else if(i==1){
+                z+=(15.0+6.25*alpha)/(1.0+.9*alpha+2.5*numNodes);
+            }
+            else{
+                const double ai=i-1;
+                z+=((1.0+2.55*ai)/(1.9*ai)+1.26*ai*alpha/(1.0+3.5*ai))*(z-x[i-2])/(1.0+.3*alpha);
+            }
+            double p1=0, p2=0, derivative=0;
+            for(int iteration=0; iteration<maxIterations; ++iteration){
+                p1=1.0;
+                p2=0.0;
+                for(int j=0; j<numNodes; ++j){
+                    const double p3=p2;
+                    p2=p1;
+                    p1=((2*j+1+alpha-z)*p2-(j+alpha)*p3)/(j+1);
+                }
+                derivative=(numNodes*p1-(numNodes+alpha)*p2)/z;
+                const double previous=z;
+                z=previous-p1/derivative;
+                if(std::abs(z-previous)<=accuracy*std::max(1.0, z)){
+                    break;
+                }
+            }
+            x[i]=z;
+            nodes[i]=z*variance;
+            weights[i]=-exp(lgamma(alpha+numNodes)-lgamma((double)numNodes)-lgamma(shape))/(derivative*numNodes*p2);
+        }
+    }
+    /**
+    @return The probability of a loss of k*getLossUnit() for each k below
+    the cap
+    */
+    const std::vector<double>& getProbabilities() const{
+        return probabilities;
+    }
+    /**
+    @return The probability of a loss of at least
+    getProbabilities().size()*getLossUnit()
+    */
+    double getTailProbability() const{
+        return tailProbability;
+    }
+    double getLossUnit() const{
+        return lossUnit;
+    }
+    double getExpectedLoss() const{
+        double expected=tailLoss;
+        for(int k=0; k<(int)probabilities.size(); ++k){
+            expected+=k*probabilities[k];
+        }
+        return expected*lossUnit;
+    }
+    /**
+    @param q The confidence level of VaR (eg, .99)
+    @return The smallest lattice loss whose cumulative probability is at least q
+    @throws std::out_of_range if the VaR lies beyond the lattice
+    */
+    double getVaR(double q) const{
+        double cumulative=0;
+        for(int k=0; k<(int)probabilities.size(); ++k){
+            cumulative+=probabilities[k];
+            if(cumulative>=q){
+                return k*lossUnit;
+            }
+        }
+        if(tailProbability>0){
+            throw std::out_of_range("VaR lies beyond maxPoints*lossUnit");
+        }
+        return (probabilities.size()-1)*lossUnit;
+    }
+    /**
+    @param q The confidence level (eg, .99)
+    @return The expected loss in the worst 1-q of outcomes
+    @throws std::out_of_range if the tail mass exceeds 1-q
+    */
+    double getEShortfall(double q) const{
+        if(tailProbability>1-q){
+            throw std::out_of_range("expected shortfall lies beyond maxPoints*lossUnit");
+        }
+        double tail=tailProbability;
+        double val=tailLoss;
+        for(int k=probabilities.size()-1; k>=0; --k){
+            if(tail>=1-q){
+                break;
+            }
+            const double probability=std::min(probabilities[k], (1-q)-tail);
+            tail+=probability;
+            val+=probability*k;
+        }
+        return val*lossUnit/(1-q);
+    }
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,238 @@
+#ifndef __PORTFOLIO_H_INCLUDED__
+#define __PORTFOLIO_H_INCLUDED__
+#include <vector>
+#include <tuple>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+#include "ThreadPool.h"
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+/**
+AlignedAllocator returns memory aligned to Alignment bytes so
+that the columns of the Portfolio start on cache line boundaries.
+*/
+template<typename T, std::size_t Alignment=64>
+struct AlignedAllocator{
+    typedef T value_type;
+    template<typename U>
+    struct rebind{
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+    AlignedAllocator(){}
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&){}
+    T* allocate(std::size_t n){
+        void* ptr=nullptr;
+        #if defined(_MSC_VER)
+        ptr=_aligned_malloc(n*sizeof(T), Alignment);
+        #else
+        if(posix_memalign(&ptr, Alignment, n*sizeof(T))!=0){
+            ptr=nullptr;
+        }
+        #endif
+        if(ptr==nullptr){
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, std::size_t){
+        #if defined(_MSC_VER)
+        _aligned_free(ptr);
+        #else
+        free(ptr);
+        #endif
+    }
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const{
+        return true;
+    }
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const{
+        return false;
+    }
+};
+/**
+Portfolio is a dense, column oriented store of the loans in a
+portfolio.  Each attribute is a contiguous, aligned column over
+all loans and the coefficients and attribute means are stored once
+for the whole portfolio rather than once per loan.  Time on books
+and time remaining are also columns.
+*/
+class Portfolio{
+private:
+    typedef std::vector<double, AlignedAllocator<double> > Column;
+    int numAttributes;
+    int numLoans;
+    std::vector<Column> attributes;
+    std::vector<double> coefficients;
+    std::vector<double> attributeMeans;
+    Column timeOnBooks;
+    Column timeRemaining;
+public:
+    /**
+    @param numAttributes_ The number of attributes for each loan
+    */
+    Portfolio(int numAttributes_):numAttributes(numAttributes_), numLoans(0), attributes(numAttributes_), coefficients(numAttributes_, 0.0), attributeMeans(numAttributes_, 0.0){
+    }
+    /**
+    Converts the per loan tuples of attribute, attribute mean and
+    coefficient into a Portfolio.  The coefficients and means are
+    stored once, so every loan must have the same ones; a portfolio
+    mixing models throws std::invalid_argument rather than pricing
+    every loan with the first loan's model.
+    @param timeOnBooks_ The time each loan has been on the books
+    @param timeRemaining_ The time until each loan matures
+    @param attributesAndCoefficients Tuples of attribute, attribute mean and coefficient for each loan
+    @return The Portfolio
+    */
+    template<typename C, typename Tuple>
+    static Portfolio fromTuples(const std::vector<C>& timeOnBooks_, const std::vector<C>& timeRemaining_, const std::vector<std::vector<Tuple> >& attributesAndCoefficients){
+        const int m=attributesAndCoefficients.empty()?0:attributesAndCoefficients.front().size();
+        Portfolio portfolio(m);
+        portfolio.reserve(attributesAndCoefficients.size());
+        std::vector<double> loanAttributes(m);
+        for(int j=0; j<m; ++j){
+            portfolio.attributeMeans[j]=std::get<1>(attributesAndCoefficients.front()[j]);
+            portfolio.coefficients[j]=std::get<2>(attributesAndCoefficients.front()[j]);
+        }
+        for(int i=0; i<(int)attributesAndCoefficients.size(); ++i){
+            if((int)attributesAndCoefficients[i].size()!=m){
+                throw std::invalid_argument("Portfolio::fromTuples: loans have different numbers of attributes");
+            }
+            for(int j=0; j<m; ++j){
+                const auto& tuple=attributesAndCoefficients[i][j];
+                if(std::get<1>(tuple)!=portfolio.attributeMeans[j]||std::get<2>(tuple)!=portfolio.coefficients[j]){
+                    throw std::invalid_argument("Portfolio::fromTuples: loans have different coefficients or attribute means");
+                }
+                loanAttributes[j]=std::get<0>(tuple);
+            }
+            portfolio.addLoan(timeOnBooks_[i], timeRemaining_[i], loanAttributes);
+        }
+        return portfolio;
+    }
+    void reserve(int n){
+        for(auto& column:attributes){
+            column.reserve(n);
+        }
+        timeOnBooks.reserve(n);
+        timeRemaining.reserve(n);
+    }
+    /**
+    @param timeOnBooks_ The time the loan has been on the books
+    @param timeRemaining_ The time until the loan matures
+    @param loanAttributes The attributes of the loan, one per coefficient
+    */
+    void addLoan(double timeOnBooks_, double timeRemaining_, const std::vector<double>& loanAttributes){
+        for(int j=0; j<numAttributes; ++j){
+            attributes[j].emplace_back(loanAttributes[j]);
+        }
+        timeOnBooks.emplace_back(timeOnBooks_);
+        timeRemaining.emplace_back(timeRemaining_);
+        ++numLoans;
+    }
+    /**
+    @param coefficients_ The model coefficients, one per attribute
+    */
+    void setCoefficients(const std::vector<double>& coefficients_){
+        coefficients=coefficients_;
+    }
+    /**
+    @param attributeMeans_ The means used to de-mean each attribute
+    */
+    void setAttributeMeans(const std::vector<double>& attributeMeans_){
+        attributeMeans=attributeMeans_;
+    }
+    /**
+    Sets the attribute means to the sample means of the portfolio
+    */
+    void computeAttributeMeans(){
+        for(int j=0; j<numAttributes; ++j){
+            double sum=0;
+            for(int i=0; i<numLoans; ++i){
+                sum+=attributes[j][i];
+            }
+            attributeMeans[j]=numLoans>0?sum/numLoans:0.0;
+        }
+    }
+    /**
+    Computes the de-meaned linear predictor of every loan for several 
+    coefficient sets in one pass.  The loans are split into blocks small 
+    enough that a block of every attribute column stays in cache while 
+    all coefficient sets are applied to it, and the blocks are run as 
+    tasks of the pool.  The inner loop is a contiguous multiply-add which 
+    the compiler vectorizes.  Each attribute is de-meaned before it is 
+    multiplied, in the same order as shazard::linearPredictor, so large 
+    attributes with a small spread keep their precision.
+    @param coefficientSets Coefficient vectors, one coefficient per attribute in each
+    @param pool The pool to run on
+    @return The linear predictors of each loan for each coefficient set
+    */
+    std::vector<std::vector<double> > linearPredictors(const std::vector<std::vector<double> >& coefficientSets, WorkStealingPool& pool=defaultPool()) const{
+        const int blockSize=2048;
+        const int numSets=coefficientSets.size();
+        const int numBlocks=(numLoans+blockSize-1)/blockSize;
+        std::vector<std::vector<double> > result(numSets, std::vector<double>(numLoans));
+        pool.parallelFor(numBlocks, [&](int block){
+            const int begin=block*blockSize;
+            const int end=std::min(begin+blockSize, numLoans);
+            for(int k=0; k<numSets; ++k){
+                double* out=result[k].data();
+                std::fill(out+begin, out+end, 0.0);
+                for(int j=0; j<numAttributes; ++j){
+                    const double coefficient=coefficientSets[k][j];
+                    const double mean=attributeMeans[j];
+                    const double* column=attributes[j].data();
+                    for(int i=begin; i<end; ++i){
+                        out[i]+=(column[i]-mean)*coefficient;
+                    }
+                }
+            }
+        });
+        return result;
+    }
+    /**
+    Computes the de-meaned linear predictor of every loan for a swapped 
+    in coefficient vector, without changing the stored coefficients.
+    @param coefficients_ The coefficients, one per attribute
+    @return The linear predictor of each loan
+    */
+    std::vector<double> linearPredictors(const std::vector<double>& coefficients_) const{
+        return std::move(linearPredictors(std::vector<std::vector<double> >(1, coefficients_)).front());
+    }
+    /**
+    Computes the de-meaned linear predictor of every loan using the 
+    stored coefficients.
+    @return The linear predictor of each loan
+    */
+    std::vector<double> linearPredictors() const{
+        return linearPredictors(coefficients);
+    }
+    double getAttribute(int loan, int attribute) const{
+        return attributes[attribute][loan];
+    }
+    const double* getAttributeColumn(int attribute) const{
+        return attributes[attribute].data();
+    }
+    double getTimeOnBooks(int loan) const{
+        return timeOnBooks[loan];
+    }
+    double getTimeRemaining(int loan) const{
+        return timeRemaining[loan];
+    }
+    const std::vector<double>& getCoefficients() const{
+        return coefficients;
+    }
+    const std::vector<double>& getAttributeMeans() const{
+        return attributeMeans;
+    }
+    int getNumAttributes() const{
+        return numAttributes;
+    }
+    int size() const{
+        return numLoans;
+    }
+};
+#endif
\ No newline at end of file
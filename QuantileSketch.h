@@ -0,0 +1,329 @@
+#ifndef __QUANTILESKETCH_H_INCLUDED__
+#define __QUANTILESKETCH_H_INCLUDED__
+#include <vector>
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include "RiskContribution.h"
+const uint32_t sketchFileMagic=0x4b534853;//"SHSK"
+const uint32_t sketchFileVersion=1;
+/**
+QuantileSketch answers getVaR and getEShortfall, as RiskContribution
+does, without storing every scenario.  The worst tailSize losses are
+kept exactly, so VaR and ES at levels inside the tail have no error.
+Every other loss goes into a KLL sketch (Karnin, Lang and Liberty 2016)
+whose levels hold items of weight 2^level.  When a level is full it is
+sorted and every other item is promoted to the next level.  The rank
+error of the body is about 1.7/k of the number of losses, and memory
+is O(k+tailSize) however many losses are added.  Sketches built on
+different threads or shards can be merged.  Compaction uses a fixed
+sequence of coin flips, so results are reproducible.
+*/
+template <int D>
+class QuantileSketch{
+private:
+    int k;
+    int tailSize;
+    long long count;
+    uint64_t coinState;
+    std::priority_queue<double, std::vector<double>, std::greater<double> > tail;//worst losses, least bad on top
+    std::vector<std::vector<double> > levels;
+    /**
+    Losses are stored negated for Lower so that worse is always larger
+    */
+    static double orient(double loss){
+        return D==Lower?-loss:loss;
+    }
+    int capacity(int level) const{
+        const int height=levels.size();
+        return std::max(2, (int)(k*pow(2.0/3.0, height-1-level)));
+    }
+    int nextCoin(){
+        coinState^=coinState<<13;
+        coinState^=coinState>>7;
+        coinState^=coinState<<17;
+        return (int)(coinState>>63);
+    }
+    void compress(){
+        for(int level=0; level<(int)levels.size(); ++level){
+            if((int)levels[level].size()>=capacity(level)){
+                if(level+1==(int)levels.size()){
+                    levels.emplace_back();
+                }
+                std::vector<double>& items=levels[level];
+                std::sort(items.begin(), items.end());
+                const int kept=items.size()%2;//an odd item out stays at this level
+                for(int i=kept+nextCoin(); i<(int)items.size(); i+=2){
+                    levels[level+1].emplace_back(items[i]);
+                }
+                items.resize(kept);
+            }
+        }
+    }
+    void addToBody(double value){
+        levels[0].emplace_back(value);
+        if((int)levels[0].size()>=capacity(0)){
+            compress();
+        }
+    }
+    void addOriented(double value){
+        ++count;
+        if((int)tail.size()<tailSize){
+            tail.push(value);
+        }
+        else if(value>tail.top()){
+            addToBody(tail.top());
+            tail.pop();
+            tail.push(value);
+        }
+        else{
+            addToBody(value);
+        }
+    }
+    /**
+    @return The exact tail, worst first
+    */
+    std::vector<double> sortedTail() const{
+        auto copy=tail;
+        std::vector<double> result;
+        while(!copy.empty()){
+            result.emplace_back(copy.top());
+            copy.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+    /**
+    @return The body items and their weights, in ascending order
+    */
+    std::vector<std::pair<double, long long> > weightedBody() const{
+        std::vector<std::pair<double, long long> > items;
+        for(int level=0; level<(int)levels.size(); ++level){
+            for(double value:levels[level]){
+                items.emplace_back(value, 1LL<<level);
+            }
+        }
+        std::sort(items.begin(), items.end());
+        return items;
+    }
+    void checkQuery(double q) const{
+        if(count==0){
+            throw std::logic_error("the sketch is empty");
+        }
+        if(!(q>=0&&q<1)){
+            throw std::invalid_argument("q must be in [0, 1)");
+        }
+    }
+public:
+    /**
+    @param k_ Accuracy of the body; the rank error is about 1.7/k_
+    @param tailSize_ Number of the worst losses kept exactly
+    @throws std::invalid_argument if k_ or tailSize_ is not positive
+    */
+    QuantileSketch(int k_=200, int tailSize_=1000):k(k_), tailSize(tailSize_), count(0), coinState(0x9E3779B97F4A7C15ULL), levels(1){
+        if(k<=0||tailSize<=0){
+            throw std::invalid_argument("k and tailSize must be positive");
+        }
+    }
+    /**
+    @param loss A scenario loss
+    */
+    void add(double loss){
+        addOriented(orient(loss));
+    }
+    /**
+    Adds the losses of another sketch with the same k and tailSize
+    @param other The sketch to merge in
+    @throws std::invalid_argument if k or tailSize differ
+    */
+    void merge(const QuantileSketch& other){
+        if(other.k!=k||other.tailSize!=tailSize){
+            throw std::invalid_argument("sketches with different k or tailSize cannot be merged");
+        }
+        for(double value:other.sortedTail()){
+            addOriented(value);
+        }
+        if(other.levels.size()>levels.size()){
+            levels.resize(other.levels.size());
+        }
+        for(int level=0; level<(int)other.levels.size(); ++level){
+            levels[level].insert(levels[level].end(), other.levels[level].begin(), other.levels[level].end());
+            count+=(long long)other.levels[level].size()<<level;
+        }
+        for(int level=0; level<(int)levels.size(); ++level){
+            if((int)levels[level].size()>=capacity(level)){
+                compress();
+                level=-1;
+            }
+        }
+    }
+    /**
+    Computes the Value at Risk, with the same convention as
+    RiskContribution::getVaR.
+    @param q The confidence level of VaR (eg, .99)
+    @return Portfolio VaR
+    @throws std::logic_error if the sketch is empty
+    */
+    double getVaR(double q) const{
+        checkQuery(q);
+        const long long index=(long long)(q*count);
+        const long long fromWorst=count-1-index;
+        if(fromWorst<(long long)tail.size()){
+            return orient(sortedTail()[fromWorst]);
+        }
+        long long cumulative=0;
+        const auto body=weightedBody();
+        for(const auto& item:body){
+            cumulative+=item.second;
+            if(cumulative>index){
+                return orient(item.first);
+            }
+        }
+        return orient(body.back().first);
+    }
+    /**
+    Computes the Expected Shortfall, with the same convention as
+    RiskContribution::getEShortfall.
+    @param q The confidence level (eg, .99)
+    @return Portfolio Expected Shortfall
+    @throws std::logic_error if the sketch is empty
+    */
+    double getEShortfall(double q) const{
+        checkQuery(q);
+        const long long index=(long long)(q*count);
+        const long long numTail=count-index;
+        const auto worst=sortedTail();
+        double val=0;
+        for(long long i=0; i<std::min(numTail, (long long)worst.size()); ++i){
+            val+=worst[i];
+        }
+        long long remaining=numTail-worst.size();
+        if(remaining>0){
+            const auto body=weightedBody();
+            for(int i=body.size()-1; i>=0&&remaining>0; --i){
+                const long long weight=std::min(body[i].second, remaining);
+                val+=weight*body[i].first;
+                remaining-=weight;
+            }
+        }
+        return orient(val/numTail);
+    }
+    /**
+    @return The number of losses added
+    */
+    long long size() const{
+        return count;
+    }
+    /**
+    @return The number of values held
+    */
+    int numRetained() const{
+        int retained=tail.size();
+        for(const auto& level:levels){
+            retained+=level.size();
+        }
+        return retained;
+    }
+    /**
+    Writes the sketch so that a shard's sketch can be merged elsewhere.  
+    The file starts with a magic number and a format version, as the 
+    loss files of ScenarioLosses do.
+    @param fileName The file to write
+    @return Whether the file was written
+    */
+    bool save(const std::string& fileName) const{
+        std::ofstream file(fileName, std::ios::binary|std::ios::trunc);
+        const auto worst=sortedTail();
+        const int numLevels=levels.size();
+        const int numWorst=worst.size();
+        file.write((const char*)&sketchFileMagic, sizeof(sketchFileMagic));
+        file.write((const char*)&sketchFileVersion, sizeof(sketchFileVersion));
+        file.write((const char*)&k, sizeof(k));
+        file.write((const char*)&tailSize, sizeof(tailSize));
+        file.write((const char*)&count, sizeof(count));
+        file.write((const char*)&coinState, sizeof(coinState));
+        file.write((const char*)&numWorst, sizeof(numWorst));
+        file.write((const char*)worst.data(), numWorst*sizeof(double));
+        file.write((const char*)&numLevels, sizeof(numLevels));
+        for(const auto& level:levels){
+            const int numItems=level.size();
+            file.write((const char*)&numItems, sizeof(numItems));
+            file.write((const char*)level.data(), numItems*sizeof(double));
+        }
+        return (bool)file;
+    }
+    /**
+    Reads a sketch written by save.  The magic number and version are 
+    checked, the lengths are checked against each other and against the 
+    size of the file, and the sketch is left
+    unchanged unless the whole file is valid.
+    @param fileName The file to read
+    @return Whether the file was read
+    */
+    bool load(const std::string& fileName){
+        std::ifstream file(fileName, std::ios::binary|std::ios::ate);
+        if(!file){
+            return false;
+        }
+        long long remaining=file.tellg();
+        file.seekg(0);
+        auto readLength=[&](int& length, int maxLength, long long itemBytes){
+            length=-1;
+            file.read((char*)&length, sizeof(length));
+            remaining-=sizeof(length);
+            return file&&length>=0&&length<=maxLength&&length*itemBytes<=remaining;
+        };
+        auto readDoubles=[&](std::vector<double>& values, int length){
+            values.resize(length);
+            file.read((char*)values.data(), length*sizeof(double));
+            remaining-=length*sizeof(double);
+        };
+        uint32_t magic=0, version=0;
+        int newK=0, newTailSize=0, numWorst=0, numLevels=0;
+        long long newCount=0;
+        uint64_t newCoinState=0;
+        file.read((char*)&magic, sizeof(magic));
+        file.read((char*)&version, sizeof(version));
+        file.read((char*)&newK, sizeof(newK));
+        file.read((char*)&newTailSize, sizeof(newTailSize));
+        file.read((char*)&newCount, sizeof(newCount));
+        file.read((char*)&newCoinState, sizeof(newCoinState));
+        remaining-=sizeof(magic)+sizeof(version)+sizeof(newK)+sizeof(newTailSize)+sizeof(newCount)+sizeof(newCoinState);
+        if(!file||magic!=sketchFileMagic||version!=sketchFileVersion||newK<=0||newTailSize<=0||newCount<0||!readLength(numWorst, newTailSize, sizeof(double))){
+            return false;
+        }
+        std::vector<double> worst;
+        readDoubles(worst, numWorst);
+        const int maxLevels=62;//so that 1LL<<level holds a weight
+        if(!readLength(numLevels, maxLevels, sizeof(int))||numLevels<1){
+            return false;
+        }
+        std::vector<std::vector<double> > newLevels(numLevels);
+        long long weight=numWorst;
+        for(int level=0; level<numLevels; ++level){
+            int numItems=0;
+            if(!readLength(numItems, std::numeric_limits<int>::max(), sizeof(double))||numItems>(newCount>>level)){
+                return false;
+            }
+            readDoubles(newLevels[level], numItems);
+            weight+=(long long)numItems<<level;
+        }
+        if(!file||remaining!=0||weight!=newCount){
+            return false;
+        }
+        k=newK;
+        tailSize=newTailSize;
+        count=newCount;
+        coinState=newCoinState;
+        tail=decltype(tail)(worst.begin(), worst.end());
+        levels=std::move(newLevels);
+        return true;
+    }
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#ifndef __RCOUNTER_H_INCLUDED__
+#define __RCOUNTER_H_INCLUDED__
+#include <cstdint>
+#include <array>
+#include <cmath>
+/**
+RCounter is a counter based random number generator (Philox4x32-10,
+Salmon et al 2011).  Every draw is a pure function of
+(seed, scenario, loan, draw), so any thread can produce any draw
+in constant time, results do not depend on the number of threads
+and there is no generator state to carry around.  Unlike RUnif
+and RNorm, one RCounter can be shared by every thread.
+*/
+class RCounter{
+private:
+    uint64_t seed;
+    static void mulhilo(uint32_t a, uint32_t b, uint32_t& hi, uint32_t& lo){
+        const uint64_t product=(uint64_t)a*b;
+        hi=(uint32_t)(product>>32);
+        lo=(uint32_t)product;
+    }
+    static double toUnif(uint32_t hi, uint32_t lo){
+        const uint64_t bits=(((uint64_t)hi<<32)|lo)>>11;
+        return (bits+.5)*(1.0/9007199254740992.0);//in (0, 1), never 0 or 1
+    }
+public:
+    RCounter(uint64_t seed_):seed(seed_){
+    }
+    uint64_t getSeed() const{
+        return seed;
+    }
+    /**
+    The Philox4x32-10 bijection
+    @param counter The 128 bit counter
+    @param key The 64 bit key
+    @return 128 random bits
+    */
+    static std::array<uint32_t, 4> philox(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key){
+        for(int round=0; round<10; ++round){
+            uint32_t hi0, lo0, hi1, lo1;
+            mulhilo(0xD2511F53, counter[0], hi0, lo0);
+            mulhilo(0xCD9E8D57, counter[2], hi1, lo1);
+            counter={hi1^counter[1]^key[0], lo1, hi0^counter[3]^key[1], lo0};
+            key[0]+=0x9E3779B9;
+            key[1]+=0xBB67AE85;
+        }
+        return counter;
+    }
+    /**
+    @return 128 random bits for the given indices
+    */
+    std::array<uint32_t, 4> getBits(uint64_t scenario, uint32_t loan, uint32_t draw) const{
+        return philox({draw, loan, (uint32_t)scenario, (uint32_t)(scenario>>32)}, {(uint32_t)seed, (uint32_t)(seed>>32)});
+    }
+    /**
+    @param scenario The index of the scenario
+    @param loan The index of the loan
+    @param draw The index of the draw for this loan and scenario
+    @return A uniform random number in (0, 1)
+    */
+    double getUnif(uint64_t scenario, uint32_t loan, uint32_t draw=0) const{
+        const auto bits=getBits(scenario, loan, draw);
+        return toUnif(bits[0], bits[1]);
+    }
+    /**
+    @param scenario The index of the scenario
+    @param loan The index of the loan
+    @param draw The index of the draw for this loan and scenario
+    @return Two independent uniform random numbers in (0, 1)
+    */
+    std::array<double, 2> getUnifPair(uint64_t scenario, uint32_t loan, uint32_t draw=0) const{
+        const auto bits=getBits(scenario, loan, draw);
+        return {toUnif(bits[0], bits[1]), toUnif(bits[2], bits[3])};
+    }
+    /**
+    @param scenario The index of the scenario
+    @param loan The index of the loan
+    @param draw The index of the draw for this loan and scenario
+    @return A standard normal random number (Box-Muller)
+    */
+    double getNorm(uint64_t scenario, uint32_t loan, uint32_t draw=0) const{
+        const auto unifs=getUnifPair(scenario, loan, draw);
+        return sqrt(-2.0*log(unifs[0]))*cos(6.283185307179586*unifs[1]);
+    }
+};
+#endif
\ No newline at end of file
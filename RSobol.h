@@ -0,0 +1,125 @@
+#ifndef __RSOBOL_H_INCLUDED__
+#define __RSOBOL_H_INCLUDED__
+#include <cstdint>
+#include <array>
+#include "RCounter.h"
+/**
+RSobol is a scrambled Sobol sequence which can replace RUnif where
+low discrepancy draws reduce the number of paths needed, eg for the
+frailty.  The first numSobolDimensions dimensions are a joint Sobol
+sequence (Joe and Kuo 2008 direction numbers).  Higher dimensions are
+padded with one dimensional sequences which are shuffled independently
+(Burley 2020), so every dimension on its own is still stratified.
+Points are Owen scrambled with a hash based nested uniform scramble,
+so runs with different seeds are independent randomizations of the
+same sequence and their spread gives error bars.  Like RCounter each
+draw is a pure function of (seed, point, dimension).
+*/
+class RSobol{
+public:
+    static const int numSobolDimensions=8;
+private:
+    uint64_t seed;
+    uint32_t dimension;
+    uint64_t point;
+    typedef std::array<std::array<uint32_t, 32>, numSobolDimensions> DirectionNumbers;
+    static const DirectionNumbers& directionNumbers(){
+        static const DirectionNumbers v=[](){
+            //degree, polynomial coefficients and initial m for dimensions 2 to 8 of Joe and Kuo
+            const int s[]={1, 2, 3, 3, 4, 4, 5};
+            const uint32_t a[]={0, 1, 1, 2, 1, 4, 2};
+            const uint32_t m[][5]={{1}, {1, 3}, {1, 3, 1}, {1, 1, 1}, {1, 1, 3, 3}, {1, 3, 5, 13}, {1, 1, 5, 5, 17}};
+            DirectionNumbers result;
+            for(int k=0; k<32; ++k){
+                result[0][k]=1u<<(31-k);
+            }
+            for(int d=1; d<numSobolDimensions; ++d){
+                const int degree=s[d-1];
+                for(int k=0; k<32; ++k){
+                    if(k<degree){
+                        result[d][k]=m[d-1][k]<<(31-k);
+                    }
+                    else{
+                        uint32_t value=result[d][k-degree]^(result[d][k-degree]>>degree);
+                        for(int j=1; j<degree; ++j){
+                            value^=((a[d-1]>>(degree-1-j))&1)*result[d][k-j];
+                        }
+                        result[d][k]=value;
+                    }
+                }
+            }
+            return result;
+        }();
+        return v;
+    }
+    static uint32_t reverseBits(uint32_t x){
+        x=((x>>1)&0x55555555u)|((x&0x55555555u)<<1);
+        x=((x>>2)&0x33333333u)|((x&0x33333333u)<<2);
+        x=((x>>4)&0x0F0F0F0Fu)|((x&0x0F0F0F0Fu)<<4);
+        x=((x>>8)&0x00FF00FFu)|((x&0x00FF00FFu)<<8);
+        return (x>>16)|(x<<16);
+    }
+    /**
+    Laine-Karras hash applied to the reversed bits, so each bit is
+    flipped depending only on the bits more significant than it
+    */
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t scrambleSeed){
+        x=reverseBits(x);
+        x+=scrambleSeed;
+        x^=x*0x6c50b47cu;
+        x^=x*0xb82f1e52u;
+        x^=x*0xc7afe638u;
+        x^=x*0x8d22f6e6u;
+        return reverseBits(x);
+    }
+    uint32_t hashSeed(uint32_t dimension_, uint32_t purpose) const{
+        return RCounter::philox({dimension_, purpose, 0, 0}, {(uint32_t)seed, (uint32_t)(seed>>32)})[0];
+    }
+public:
+    /**
+    @param seed_ The seed of the randomization
+    @param dimension_ The dimension returned by getUnif()
+    */
+    RSobol(uint64_t seed_, uint32_t dimension_=0):seed(seed_), dimension(dimension_), point(0){
+    }
+    /**
+    Unscrambled Sobol sequence
+    @param index The index of the point
+    @param dimension_ The dimension, less than numSobolDimensions
+    @return The coordinate as a 32 bit fraction
+    */
+    static uint32_t sobol(uint32_t index, int dimension_){
+        const auto& v=directionNumbers()[dimension_];
+        uint32_t result=0;
+        for(int k=0; index!=0; ++k, index>>=1){
+            if(index&1){
+                result^=v[k];
+            }
+        }
+        return result;
+    }
+    /**
+    @param index The index of the point
+    @param dimension_ The dimension
+    @return The scrambled coordinate in (0, 1)
+    */
+    double getUnif(uint64_t index, uint32_t dimension_) const{
+        uint32_t bits;
+        if(dimension_<(uint32_t)numSobolDimensions){
+            bits=sobol(nestedUniformScramble((uint32_t)index, hashSeed(0, 0)), dimension_);
+        }
+        else{
+            bits=sobol(nestedUniformScramble((uint32_t)index, hashSeed(dimension_, 0)), 0);
+        }
+        bits=nestedUniformScramble(bits, hashSeed(dimension_, 1));
+        return (bits+.5)*(1.0/4294967296.0);//in (0, 1), never 0 or 1
+    }
+    /**
+    Drop in replacement for RUnif::getUnif
+    @return The next point of the dimension given to the constructor
+    */
+    double getUnif(){
+        return getUnif(point++, dimension);
+    }
+};
+#endif
\ No newline at end of file
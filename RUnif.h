@@ -23,6 +23,20 @@ public:
   double getUnif(){
     return unif(generator); 
   }
+  /**
+  Fills an array with uniforms in (0, 1).  These are built 
+  directly from the bits of the generator rather than through 
+  std::uniform_real_distribution, so the stream is the same 
+  with every standard library.  Each step is exact in floating 
+  point, so this holds bit for bit whatever the compiler flags.
+  @param out Pointer to the outputs
+  @param n Number of uniforms
+  */
+  void fill(double* out, size_t n){
+    for(size_t i=0; i<n; ++i){
+      out[i]=((generator()>>11)+.5)*(1.0/9007199254740992.0);
+    }
+  }
 
 };
 #endif
\ No newline at end of file
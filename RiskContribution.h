@@ -2,9 +2,21 @@
 #define __RISKCONTRIBUTION_H_INCLUDED__
 #include <vector>
 #include <numeric>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "FunctionalUtilities"
+#include "ThreadPool.h"
 const int Upper=0;
 const int Lower=1;
 /**
+VaR and Expected Shortfall at several confidence levels
+*/
+struct TailMetrics{
+    std::vector<double> VaR;
+    std::vector<double> eShortfall;
+};
+/**
 The RiskContribution class computes
 risk metrics and marginal risk metrics 
 for portfolios of loans and for individual 
@@ -17,35 +29,176 @@ private:
     std::vector<size_t> idx;
     int m;
     const std::vector<double>& port;
-    
+    bool isSorted;
+    std::vector<double> selection;//copy of port, partially ordered by the selections so far
+    static bool isBetter(double a, double b){
+        return D==Lower?a>b:a<b;
+    }
+    void ensureSorted(){
+        if(!isSorted){
+            idx=sort_indexes(port);
+            isSorted=true;
+        }
+    }
+    /**
+    Partitions the copy of the losses so that the element at rank is
+    in place with better outcomes before it and worse after it.
+    */
+    void select(int rank){
+        if(selection.empty()){
+            selection=port;
+        }
+        std::nth_element(selection.begin(), selection.begin()+rank, selection.end(), isBetter);
+    }
+    /**
+    Var-Cov risk contributions from sums over count scenarios (or 
+    the total weight of importance sampled scenarios)
+    */
+    template<typename Cov, typename Exloss, typename Variance, typename VaR>
+    auto rcCov(std::vector<Cov>&& cov, const std::vector<Exloss>& exloss, const Exloss& portfolioExLoss, const Variance& portfolioVariance, const VaR& portfolioVaR, double count){
+        auto varScalar=(portfolioVaR-portfolioExLoss)/portfolioVariance;
+        return futilities::for_each_parallel(cov, [&](const auto& val, const auto& index){
+            auto mean=exloss[index]/count;
+            return mean+(val-mean*portfolioExLoss)*count/(count-1)*varScalar;
+        });
+    }
+    /**
+    Walks down from the worst scenario until the likelihood
+    ratio weighted tail probability reaches 1-q.
+    */
+    int weightedTailIndex(double q, const std::vector<double>& weights){
+        ensureSorted();
+        const double tailTarget=(1-q)*m;
+        double tailWeight=0;
+        int i=m-1;
+        for(; i>0; --i){
+            tailWeight+=weights[idx[i]];
+            if(tailWeight>=tailTarget){
+                break;
+            }
+        }
+        return i;
+    }
 public:
+    static const size_t radixSortThreshold=1<<16;
+    /**
+    Stable comparison argsort, so that ties keep their scenario order 
+    as in radix_sort_indexes and both give the same indices
+    */
     template <typename T>
-    std::vector<size_t> sort_indexes(const std::vector<T> &v) {
+    std::vector<size_t> comparison_sort_indexes(const std::vector<T> &v) {
         // initialize original index locations
         std::vector<size_t> idx(v.size());
         std::iota(idx.begin(), idx.end(), 0);
         // sort indexes based on comparing values in v
         switch(D){ //if D=Upper than the losses are "positive", else losses are "negative"
             case 0:
-                std::sort(idx.begin(), idx.end(),
+                std::stable_sort(idx.begin(), idx.end(),
                     [&v](size_t i1, size_t i2) {return v[i1] < v[i2];});
                 break;    
             case 1:
-                std::sort(idx.begin(), idx.end(),
+                std::stable_sort(idx.begin(), idx.end(),
                     [&v](size_t i1, size_t i2) {return v[i1] > v[i2];});   
                 break;     
             default:        
-                std::sort(idx.begin(), idx.end(),
+                std::stable_sort(idx.begin(), idx.end(),
                     [&v](size_t i1, size_t i2) {return v[i1] < v[i2];});
         }
         return idx;
     }
     /**
+    Parallel LSD radix argsort.  Each double is mapped to an unsigned
+    key with the same order (flip every bit of negatives, the sign bit
+    of positives), inverted for Lower, and the keys are sorted 11 bits
+    at a time.  The keys are split into one slice per worker of the 
+    pool; each pass counts the digits of every slice and then scatters 
+    each slice to its own offsets, so each pass is stable and ties keep 
+    their scenario order.  Passes where every key has the same digit 
+    are skipped.  -0.0 is mapped to the key of 0.0, so the two tie as 
+    they do in comparison_sort_indexes.  NaNs have no order under either 
+    sort and must not be passed.
+    @param v The values
+    @param pool The pool to run on
+    @return The indices of v in ascending (Upper) or descending (Lower) order
+    */
+    std::vector<size_t> radix_sort_indexes(const std::vector<double>& v, WorkStealingPool& pool=defaultPool()){
+        const int digitBits=11;
+        const int numDigits=1<<digitBits;
+        const size_t n=v.size();
+        const int numSlices=pool.size();
+        std::vector<uint64_t> keys(n), keysOut(n);
+        std::vector<size_t> idx(n), idxOut(n);
+        auto sliceBegin=[&](int t){
+            return n*t/numSlices;
+        };
+        pool.parallelFor(numSlices, [&](int t){
+            for(size_t i=sliceBegin(t); i<sliceBegin(t+1); ++i){
+                const double value=v[i]==0.0?0.0:v[i];//-0.0 ties with 0.0
+                uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(double));
+                const uint64_t key=(bits>>63)?~bits:bits|0x8000000000000000ULL;
+                keys[i]=D==Lower?~key:key;
+                idx[i]=i;
+            }
+        });
+        std::vector<std::vector<size_t> > counts(numSlices, std::vector<size_t>(numDigits));
+        for(int shift=0; shift<64; shift+=digitBits){
+            pool.parallelFor(numSlices, [&](int t){
+                std::fill(counts[t].begin(), counts[t].end(), 0);
+                for(size_t i=sliceBegin(t); i<sliceBegin(t+1); ++i){
+                    ++counts[t][(keys[i]>>shift)&(numDigits-1)];
+                }
+            });
+            bool isSingleDigit=false;
+            size_t offset=0;
+            for(int digit=0; digit<numDigits; ++digit){
+                size_t digitCount=0;
+                for(int t=0; t<numSlices; ++t){
+                    const size_t count=counts[t][digit];
+                    counts[t][digit]=offset;
+                    offset+=count;
+                    digitCount+=count;
+                }
+                isSingleDigit=isSingleDigit||digitCount==n;
+            }
+            if(isSingleDigit){
+                continue;
+            }
+            pool.parallelFor(numSlices, [&](int t){
+                std::vector<size_t>& positions=counts[t];
+                for(size_t i=sliceBegin(t); i<sliceBegin(t+1); ++i){
+                    const size_t position=positions[(keys[i]>>shift)&(numDigits-1)]++;
+                    keysOut[position]=keys[i];
+                    idxOut[position]=idx[i];
+                }
+            });
+            keys.swap(keysOut);
+            idx.swap(idxOut);
+        }
+        return idx;
+    }
+    /**
+    Sorts the indices of v, with a parallel radix sort above 
+    radixSortThreshold values
+    */
+    std::vector<size_t> sort_indexes(const std::vector<double> &v) {
+        return v.size()>=radixSortThreshold?radix_sort_indexes(v):comparison_sort_indexes(v);
+    }
+    template <typename T>
+    std::vector<size_t> sort_indexes(const std::vector<T> &v) {
+        return comparison_sort_indexes(v);
+    }
+    /**
     @param port Portfolio results (eg from a simulation or time series)
+    @param isLazy If true the scenarios are not sorted up front; VaR and 
+    expected shortfall are found by selection in O(m) and the indices are 
+    only sorted when a metric needs them in order
     */
-    RiskContribution(const std::vector<double>& port_):port(port_){
-        idx=sort_indexes(port_);
+    RiskContribution(const std::vector<double>& port_, bool isLazy=false):port(port_), isSorted(false){
         m=port_.size();
+        if(!isLazy){
+            ensureSorted();
+        }
     }
     /**
     Computes the Value at Risk for the portfolio 
@@ -54,7 +207,11 @@ public:
     @return Portfolio VaR
     */
     double getVaR(double q){ //eg, .99.
-        return port[idx[(int)(q*m)]];
+        if(isSorted){
+            return port[idx[(int)(q*m)]];
+        }
+        select((int)(q*m));
+        return selection[(int)(q*m)];
     }
     /**
     Computes the Expected Shortfall for the portfolio 
@@ -65,36 +222,142 @@ public:
     double getEShortfall(double q){ //eg, .99  
         int index=(int)(q*m);
         double val=0;
-        for(int i=index; i<m; ++i){
-            val+=port[idx[i]];
+        if(isSorted){
+            for(int i=index; i<m; ++i){
+                val+=port[idx[i]];
+            }
+        }
+        else{
+            select(index);//only the tail is partitioned off, it is not sorted
+            for(int i=index; i<m; ++i){
+                val+=selection[i];
+            }
         }
         return val/(m-index);
     }
     /**
+    Computes VaR and Expected Shortfall at several 
+    confidence levels in one backward pass over the 
+    tail, sharing the tail sums between levels.  In 
+    lazy mode only the tail beyond the lowest level is 
+    partitioned off and sorted.
+    @param qs The confidence levels (eg, .99), in any order
+    @return VaR and Expected Shortfall for each level, in the order of qs
+    */
+    TailMetrics getTailMetrics(const std::vector<double>& qs){
+        const int numLevels=qs.size();
+        std::vector<int> order(numLevels);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](int a, int b){return qs[a]>qs[b];});
+        TailMetrics metrics;
+        metrics.VaR.resize(numLevels);
+        metrics.eShortfall.resize(numLevels);
+        if(numLevels==0){
+            return metrics;
+        }
+        const int lowestIndex=(int)(qs[order.back()]*m);
+        if(!isSorted){
+            select(lowestIndex);
+            std::sort(selection.begin()+lowestIndex, selection.end(), isBetter);
+        }
+        auto at=[&](int i){
+            return isSorted?port[idx[i]]:selection[i];
+        };
+        double val=0;
+        int i=m;
+        for(int level:order){
+            const int index=(int)(qs[level]*m);
+            for(; i>index; --i){
+                val+=at(i-1);
+            }
+            metrics.VaR[level]=at(index);
+            metrics.eShortfall[level]=val/(m-index);
+        }
+        return metrics;
+    }
+    /**
     Computes the Var-Cov risk contributions
     for each loan in the portfolio provided 
-    in the constructor.
+    in the constructor:
+    E[X_i]+Cov(X_i, X)(VaR-E[X])/Var(X), with 
+    the unbiased sample covariance.
     @param cov The sample expectation of 
-    each loan with the portfolio: E[X_i X].  
-    This is modified and becomes the sample
-    risk contributions for each loan. 
-    @param exLoss The sum of the losses per asset.
-    This is modified and becomes the
-    sample average.
+    each loan with the portfolio: E[X_i X], ie 
+    the sum of X_i X divided by the number of 
+    scenarios.  This is modified and becomes 
+    the sample risk contributions for each loan. 
+    @param exloss The sum of the losses per asset.
+    This is divided by the number of scenarios 
+    to get the sample average.
     @param portfolioExLoss The expected loss
     for the entire portfoio.  Note that this
-    is equal to the sum of exLoss.
-    @param portfolioVariance The variance of
-    the entire portfolio.
+    is equal to the sum of exloss divided by 
+    the number of scenarios.
+    @param portfolioVariance The (unbiased) sample 
+    variance of the entire portfolio.
     @param portfolioVaR  The portfolio VaR,
     which can be computed using getVaR.
     */
     template<typename Cov, typename Exloss, typename Variance, typename VaR>
     auto getRCCov(std::vector<Cov>&& cov, const std::vector<Exloss>& exloss, const Exloss& portfolioExLoss, const Variance& portfolioVariance, const VaR& portfolioVaR){
-        auto varScalar=(portfolioVaR-portfolioExLoss)/portfolioVariance;
-        return futilities::for_each_parallel(cov, [&](const auto& val, const auto& index){
-            return (val-exLoss[index]*portfolioExLoss)*portfolioVariance/(m-1)+exLoss[index]/m;
-        });
+        return rcCov(std::move(cov), exloss, portfolioExLoss, portfolioVariance, portfolioVaR, (double)m);
+    }
+    /**
+    Computes the Value at Risk from importance sampled 
+    results.  The tail probability of a loss is estimated 
+    by the sum of the likelihood ratios of the scenarios 
+    beyond it divided by the number of scenarios.
+    @param q The confidence level of VaR (eg, .99)
+    @param weights The likelihood ratio of each scenario
+    @return Portfolio VaR
+    */
+    double getVaR(double q, const std::vector<double>& weights){
+        return port[idx[weightedTailIndex(q, weights)]];
+    }
+    /**
+    Computes the Expected Shortfall from importance 
+    sampled results.
+    @param q The confidence level (eg, .99)
+    @param weights The likelihood ratio of each scenario
+    @return Portfolio Expected Shortfall
+    */
+    double getEShortfall(double q, const std::vector<double>& weights){
+        const int index=weightedTailIndex(q, weights);
+        double tailWeight=0;
+        double val=0;
+        for(int i=m-1; i>index; --i){
+            tailWeight+=weights[idx[i]];
+            val+=weights[idx[i]]*port[idx[i]];
+        }
+        //the VaR scenario covers the rest of the tail probability
+        return (val+((1-q)*m-tailWeight)*port[idx[index]])/((1-q)*m);
+    }
+    /**
+    Computes the Var-Cov risk contributions from 
+    importance sampled results.  This is the 
+    unweighted getRCCov with every sum weighted by 
+    the likelihood ratios and the number of scenarios 
+    replaced by the total weight, so with unit weights 
+    the two agree.
+    @param cov The likelihood ratio weighted sum of 
+    X_i X divided by the total weight.  This is 
+    modified and becomes the risk contributions for 
+    each loan.
+    @param exloss The likelihood ratio weighted sum 
+    of the losses per asset.
+    @param portfolioExLoss The expected loss for the 
+    entire portfolio, ie the weighted sum of the 
+    portfolio losses divided by the total weight.
+    @param portfolioVariance The weighted sample 
+    variance of the entire portfolio, with the 
+    total weight minus one as the divisor.
+    @param portfolioVaR The portfolio VaR, which can 
+    be computed using the weighted getVaR.
+    @param weights The likelihood ratio of each scenario
+    */
+    template<typename Cov, typename Exloss, typename Variance, typename VaR>
+    auto getRCCov(std::vector<Cov>&& cov, const std::vector<Exloss>& exloss, const Exloss& portfolioExLoss, const Variance& portfolioVariance, const VaR& portfolioVaR, const std::vector<double>& weights){
+        return rcCov(std::move(cov), exloss, portfolioExLoss, portfolioVariance, portfolioVaR, std::accumulate(weights.begin(), weights.end(), 0.0));
     }
         
 };
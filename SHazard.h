@@ -3,7 +3,34 @@
 #include <cmath>
 #include <iostream>
 #include <vector>
+#include <tuple>
+#include <array>
+#include <type_traits>
+#include <stdexcept>
 #include "FunctionalUtilities"
+#include "Newton.h"
+#include "VMath.h"
+#include "Portfolio.h"
+#include "ThreadPool.h"
+#include "RCounter.h"
+#include "RSobol.h"
+#include "ScenarioLosses.h"
+#if defined(__x86_64__)||defined(_M_X64)
+#define SHAZARD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+#if defined(__GNUC__)||defined(__clang__)
+#define SHAZARD_TARGET(isa) __attribute__((target(isa)))
+#define SHAZARD_AVX512 1
+#else
+#define SHAZARD_TARGET(isa) //MSVC compiles intrinsics for any instruction set without /arch
+#if defined(_MSC_VER)&&_MSC_VER>=1911
+#define SHAZARD_AVX512 1
+#endif
+#endif
 
 const int Hazard=0;
 const int Odds=1;
@@ -23,107 +50,1413 @@ auto maxZeroOrNumber(const T& number){
 
 const double isqrt2=1.0/sqrt(2.0);
 namespace shazard {
+    /**
+    simdWidth is the number of doubles in the widest vector unit that 
+    both the CPU and the operating system support: 8 for AVX-512, 4 for 
+    AVX2 and 1 otherwise.  It is found once, at run time, so the same 
+    binary uses the widest kernel each machine has.
+    @return The number of doubles per vector
+    */
+    inline int simdWidth(){
+        static const int width=[](){
+            #if defined(SHAZARD_X86)&&(defined(__GNUC__)||defined(__clang__))
+            __builtin_cpu_init();
+            #if defined(SHAZARD_AVX512)
+            if(__builtin_cpu_supports("avx512f")){
+                return 8;
+            }
+            #endif
+            return __builtin_cpu_supports("avx2")?4:1;
+            #elif defined(SHAZARD_X86)&&defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if(info[0]<7){
+                return 1;
+            }
+            __cpuid(info, 1);
+            const bool hasXsave=(info[2]&(1<<27))!=0;//the OS saves the vector registers
+            const bool hasAvx=(info[2]&(1<<28))!=0;
+            if(!hasXsave||!hasAvx){
+                return 1;
+            }
+            const unsigned long long enabled=_xgetbv(0);
+            __cpuidex(info, 7, 0);
+            #if defined(SHAZARD_AVX512)
+            if((info[1]&(1<<16))!=0&&(enabled&0xe6)==0xe6){
+                return 8;
+            }
+            #endif
+            return (info[1]&(1<<5))!=0&&(enabled&6)==6?4:1;
+            #else
+            return 1;
+            #endif
+        }();
+        return width;
+    }
     /**cspline returns a cubic spline at a point log(t) given knots and "gamma"'s for each knot*/
     template<typename T, typename Tuple>
-    auto cspline(const num& x, const std::vector<Tuple>& knots_gamma){//x is log(t)
-        const auto minDiff=x-knots_gamma.front()<0>;//difference between given x and first knot
-        const auto maxDiff=knots_gamma.back()<0>-x;//difference between last knot and given x
-        const auto span=knots_gamma.back()<0>-knots_gamma.front()<0>;//span of knots
-        const auto tripleMin=futilities::const_power(maxZeroOrNumber(minDiff), 3); //minDiff^3, if minDiff>0 else 0
-        const auto tripleMax=futilities::const_power(maxZeroOrNumber(maxDiff), 3);//maxDiff^3, if minDiff>0 else 0
+    auto cspline(const T& x, const std::vector<Tuple>& knots_gamma){//x is log(t)
+        const auto minKnot=std::get<0>(knots_gamma.front());
+        const auto maxKnot=std::get<0>(knots_gamma.back());
+        const auto span=maxKnot-minKnot;//span of knots
+        const auto tripleMin=futilities::const_power(maxZeroOrNumber(x-minKnot), 3); //(x-minKnot)^3 if x>minKnot else 0
+        const auto tripleMax=futilities::const_power(maxZeroOrNumber(x-maxKnot), 3);//(x-maxKnot)^3 if x>maxKnot else 0
         int startFrom=1;
         int endFrom=1;
         return futilities::sum_subset(knots_gamma, startFrom, endFrom, [&](const auto& tuple, const auto& index){
-            const auto lambda=(knots_gamma.back()<0>-tuple<0>)/span;
-            const auto currDiff=x-tuple<0>;//difference between given x and first knot
-            const auto tripleCurr=futilities::const_power(maxZeroOrNumber(minDiff), 3); //minDiff^3, if minDiff>0 else 0
-            return (tripleCurr+maxDiff*(lambda-1)-minDiff*lambda)*knots_gamma[index+1]<1>;
-        })+knots_gamma.front()<1>+knots_gamma[1]<1>*x;
+            const auto lambda=(maxKnot-std::get<0>(tuple))/span;
+            const auto tripleCurr=futilities::const_power(maxZeroOrNumber(x-std::get<0>(tuple)), 3); //(x-knot)^3 if x>knot else 0
+            return (tripleCurr-lambda*tripleMin-(1-lambda)*tripleMax)*std::get<1>(knots_gamma[index+1]);
+        })+std::get<1>(knots_gamma.front())+std::get<1>(knots_gamma[1])*x;
+    }
+    /**
+    Spline is a restricted cubic spline compiled once from the knots and "gamma"'s.  
+    The interior knots, their lambdas and their gammas are stored in contiguous arrays 
+    so that evaluation is a single loop with no divisions.  Agrees with cspline 
+    to rounding error; the terms are added in a different order.
+    */
+    class Spline{
+    private:
+        std::vector<double> knots;//interior knots
+        std::vector<double> lambdas;//(maxKnot-knot)/span for each interior knot
+        std::vector<double> gammas;//gamma associated with each interior knot
+        double minKnot;
+        double maxKnot;
+        double intercept;
+        double slope;
+    public:
+        Spline(){}
+        /**
+        @param knots_gamma Vector of tuples whose first element is the knot (in log time) and 
+        whose second element is the gamma.  The first and last knots are the boundary knots.  
+        The first two gammas are the intercept and slope.
+        */
+        template<typename Tuple>
+        Spline(const std::vector<Tuple>& knots_gamma){
+            const int n=knots_gamma.size();
+            minKnot=std::get<0>(knots_gamma.front());
+            maxKnot=std::get<0>(knots_gamma.back());
+            intercept=std::get<1>(knots_gamma.front());
+            slope=std::get<1>(knots_gamma[1]);
+            const double span=maxKnot-minKnot;
+            knots.reserve(n-2);
+            lambdas.reserve(n-2);
+            gammas.reserve(n-2);
+            for(int i=1; i<n-1; ++i){
+                knots.emplace_back(std::get<0>(knots_gamma[i]));
+                lambdas.emplace_back((maxKnot-knots.back())/span);
+                gammas.emplace_back(std::get<1>(knots_gamma[i+1]));
+            }
+        }
+        /**
+        @param x Log of the time
+        @return The spline evaluated at x
+        */
+        template<typename T>
+        auto operator()(const T& x) const{
+            const auto tripleMin=futilities::const_power(maxZeroOrNumber(x-minKnot), 3);
+            const auto tripleMax=futilities::const_power(maxZeroOrNumber(x-maxKnot), 3);
+            const int n=knots.size();
+            auto val=intercept+slope*x;
+            for(int i=0; i<n; ++i){
+                const auto tripleCurr=futilities::const_power(maxZeroOrNumber(x-knots[i]), 3);
+                val+=(tripleCurr-lambdas[i]*tripleMin-(1-lambdas[i])*tripleMax)*gammas[i];
+            }
+            return val;
+        }
+    private:
+        typedef int (*BatchKernel)(const Spline&, const double*, double*, int);
+        #if defined(SHAZARD_X86)
+        #if defined(SHAZARD_AVX512)
+        /**
+        x-knot where x>knot and zero elsewhere.  A masked subtraction 
+        rather than _mm512_max_pd, which trips a false uninitialized 
+        warning in GCC 12's headers.
+        */
+        SHAZARD_TARGET("avx512f") static __m512d positivePart8(__m512d xv, double knot){
+            const __m512d knotv=_mm512_set1_pd(knot);
+            return _mm512_maskz_sub_pd(_mm512_cmp_pd_mask(xv, knotv, _CMP_GT_OQ), xv, knotv);
+        }
+        SHAZARD_TARGET("avx512f") static int batch8(const Spline& spline, const double* x, double* out, int n){
+            const int numKnots=spline.knots.size();
+            int i=0;
+            for(; i+8<=n; i+=8){
+                const __m512d xv=_mm512_loadu_pd(x+i);
+                __m512d d=positivePart8(xv, spline.minKnot);
+                const __m512d tripleMin=_mm512_mul_pd(_mm512_mul_pd(d, d), d);
+                d=positivePart8(xv, spline.maxKnot);
+                const __m512d tripleMax=_mm512_mul_pd(_mm512_mul_pd(d, d), d);
+                __m512d val=_mm512_add_pd(_mm512_set1_pd(spline.intercept), _mm512_mul_pd(_mm512_set1_pd(spline.slope), xv));
+                for(int j=0; j<numKnots; ++j){
+                    d=positivePart8(xv, spline.knots[j]);
+                    __m512d basis=_mm512_mul_pd(_mm512_mul_pd(d, d), d);
+                    basis=_mm512_sub_pd(basis, _mm512_mul_pd(_mm512_set1_pd(spline.lambdas[j]), tripleMin));
+                    basis=_mm512_sub_pd(basis, _mm512_mul_pd(_mm512_set1_pd(1-spline.lambdas[j]), tripleMax));
+                    val=_mm512_add_pd(val, _mm512_mul_pd(basis, _mm512_set1_pd(spline.gammas[j])));
+                }
+                _mm512_storeu_pd(out+i, val);
+            }
+            return i;
+        }
+        #endif
+        SHAZARD_TARGET("avx2") static int batch4(const Spline& spline, const double* x, double* out, int n){
+            const int numKnots=spline.knots.size();
+            const __m256d zero4=_mm256_setzero_pd();
+            int i=0;
+            for(; i+4<=n; i+=4){
+                const __m256d xv=_mm256_loadu_pd(x+i);
+                __m256d d=_mm256_max_pd(_mm256_sub_pd(xv, _mm256_set1_pd(spline.minKnot)), zero4);
+                const __m256d tripleMin=_mm256_mul_pd(_mm256_mul_pd(d, d), d);
+                d=_mm256_max_pd(_mm256_sub_pd(xv, _mm256_set1_pd(spline.maxKnot)), zero4);
+                const __m256d tripleMax=_mm256_mul_pd(_mm256_mul_pd(d, d), d);
+                __m256d val=_mm256_add_pd(_mm256_set1_pd(spline.intercept), _mm256_mul_pd(_mm256_set1_pd(spline.slope), xv));
+                for(int j=0; j<numKnots; ++j){
+                    d=_mm256_max_pd(_mm256_sub_pd(xv, _mm256_set1_pd(spline.knots[j])), zero4);
+                    __m256d basis=_mm256_mul_pd(_mm256_mul_pd(d, d), d);
+                    basis=_mm256_sub_pd(basis, _mm256_mul_pd(_mm256_set1_pd(spline.lambdas[j]), tripleMin));
+                    basis=_mm256_sub_pd(basis, _mm256_mul_pd(_mm256_set1_pd(1-spline.lambdas[j]), tripleMax));
+                    val=_mm256_add_pd(val, _mm256_mul_pd(basis, _mm256_set1_pd(spline.gammas[j])));
+                }
+                _mm256_storeu_pd(out+i, val);
+            }
+            return i;
+        }
+        #endif
+        static int batch1(const Spline& spline, const double* x, double* out, int n){
+            for(int i=0; i<n; ++i){
+                out[i]=spline(x[i]);
+            }
+            return n;
+        }
+        /**
+        @return The widest kernel this machine supports
+        */
+        static BatchKernel batchKernel(){
+            #if defined(SHAZARD_X86)
+            #if defined(SHAZARD_AVX512)
+            if(simdWidth()==8){
+                return &batch8;
+            }
+            #endif
+            if(simdWidth()>=4){
+                return &batch4;
+            }
+            #endif
+            return &batch1;
+        }
+    public:
+        /**
+        Evaluates the spline for an array of log times.  The AVX-512, 
+        AVX2 or scalar kernel is picked once at run time from what the 
+        CPU supports (see simdWidth), whatever the compiler flags, and 
+        the remainder is evaluated by the scalar operator().  The compiler 
+        may fuse multiplies and adds in the AVX-512 kernel, so results 
+        agree with operator() to rounding rather than bit for bit.
+        @param x Pointer to n log times
+        @param out Pointer to n results
+        @param n Number of log times
+        */
+        void batch(const double* x, double* out, int n) const{
+            static const BatchKernel kernel=batchKernel();
+            for(int i=kernel(*this, x, out, n); i<n; ++i){
+                out[i]=(*this)(x[i]);
+            }
+        }
+        /**
+        @param x Log of the time
+        @return The derivative of the spline with respect to x
+        */
+        template<typename T>
+        auto derivative(const T& x) const{
+            const auto doubleMin=futilities::const_power(maxZeroOrNumber(x-minKnot), 2);
+            const auto doubleMax=futilities::const_power(maxZeroOrNumber(x-maxKnot), 2);
+            const int n=knots.size();
+            auto val=slope+0*x;
+            for(int i=0; i<n; ++i){
+                const auto doubleCurr=futilities::const_power(maxZeroOrNumber(x-knots[i]), 2);
+                val+=3*(doubleCurr-lambdas[i]*doubleMin-(1-lambdas[i])*doubleMax)*gammas[i];
+            }
+            return val;
+        }
+        int numberOfKnots() const{
+            return knots.size()+2;
+        }
+        /**
+        @param hash Hash to continue from
+        @return The hash continued over the knots and gammas, see RunMetadata
+        */
+        uint64_t fingerprint(uint64_t hash) const{
+            const double ends[]={minKnot, maxKnot, intercept, slope};
+            hash=hashBytes(ends, sizeof(ends), hash);
+            hash=hashBytes(knots.data(), knots.size()*sizeof(double), hash);
+            return hashBytes(gammas.data(), gammas.size()*sizeof(double), hash);
+        }
+    };
+    /**
+    cspline_batch evaluates the spline for an array of log times
+    @param spline The compiled spline
+    @param x Log times
+    @return The spline evaluated at each log time
+    */
+    inline std::vector<double> cspline_batch(const Spline& spline, const std::vector<double>& x){
+        std::vector<double> out(x.size());
+        spline.batch(x.data(), out.data(), x.size());
+        return out;
+    }
+    /**
+    cspline_batch evaluates the offset spline for a single log time across many offsets
+    @param spline The compiled spline
+    @param x Log time
+    @param offsets Offsets (eg linear predictors) to add to the spline
+    @return The spline at x plus each offset
+    */
+    template<typename S>
+    std::vector<double> cspline_batch(const S& spline, double x, const std::vector<double>& offsets){
+        const double splineAtX=spline(x);
+        std::vector<double> out(offsets.size());
+        for(int i=0; i<(int)offsets.size(); ++i){
+            out[i]=splineAtX+offsets[i];
+        }
+        return out;
+    }
+    /**
+    FixedSpline is a restricted cubic spline with a compile time number of knots K 
+    (including the two boundary knots).  The knot tables live in std::arrays and 
+    the sum over the interior knots is unrolled at compile time.  The terms 
+    are added in the same order as Spline, so the two evaluate to the same 
+    bits unless the compiler is allowed to fuse multiplies and adds (eg 
+    -mfma with -ffp-contract=fast), which it may do differently in each.
+    */
+    template<std::size_t K>
+    class FixedSpline{
+    private:
+        static_assert(K>=2, "A restricted cubic spline needs at least the two boundary knots");
+        static constexpr std::size_t NumInterior=K-2;
+        std::array<double, NumInterior> knots;
+        std::array<double, NumInterior> lambdas;
+        std::array<double, NumInterior> gammas;
+        double minKnot;
+        double maxKnot;
+        double intercept;
+        double slope;
+        template<typename T>
+        static constexpr T cubePositive(const T& x){
+            return x>0?x*x*x:0;
+        }
+        /**
+        Adds the interior knot terms to val from the first knot to the 
+        last, the same order as Spline
+        */
+        template<std::size_t I, typename T>
+        constexpr T interior(const T& val, const T& x, const T& tripleMin, const T& tripleMax, std::integral_constant<std::size_t, I>) const{
+            return interior(val+(cubePositive(x-knots[I])-lambdas[I]*tripleMin-(1-lambdas[I])*tripleMax)*gammas[I], x, tripleMin, tripleMax, std::integral_constant<std::size_t, I+1>());
+        }
+        template<typename T>
+        constexpr T interior(const T& val, const T&, const T&, const T&, std::integral_constant<std::size_t, NumInterior>) const{
+            return val;
+        }
+    public:
+        /**
+        @param knots_gamma Vector of K tuples of knots and gammas, as for Spline
+        @throws std::invalid_argument if knots_gamma does not have K knots
+        */
+        template<typename Tuple>
+        FixedSpline(const std::vector<Tuple>& knots_gamma){
+            if(knots_gamma.size()!=K){
+                throw std::invalid_argument("FixedSpline: the number of knots must be K");
+            }
+            minKnot=std::get<0>(knots_gamma.front());
+            maxKnot=std::get<0>(knots_gamma.back());
+            intercept=std::get<1>(knots_gamma.front());
+            slope=std::get<1>(knots_gamma[1]);
+            const double span=maxKnot-minKnot;
+            for(std::size_t i=0; i<NumInterior; ++i){
+                knots[i]=std::get<0>(knots_gamma[i+1]);
+                lambdas[i]=(maxKnot-knots[i])/span;
+                gammas[i]=std::get<1>(knots_gamma[i+2]);
+            }
+        }
+        /**
+        @param x Log of the time
+        @return The spline evaluated at x
+        */
+        constexpr double operator()(const double& x) const{
+            return interior(intercept+slope*x, x, cubePositive(x-minKnot), cubePositive(x-maxKnot), std::integral_constant<std::size_t, 0>());
+        }
+        /**
+        @param x Log of the time
+        @return The derivative of the spline with respect to x
+        */
+        constexpr double derivative(const double& x) const{
+            const double doubleMin=x>minKnot?(x-minKnot)*(x-minKnot):0;
+            const double doubleMax=x>maxKnot?(x-maxKnot)*(x-maxKnot):0;
+            double val=slope;
+            for(std::size_t i=0; i<NumInterior; ++i){
+                const double doubleCurr=x>knots[i]?(x-knots[i])*(x-knots[i]):0;
+                val+=3*(doubleCurr-lambdas[i]*doubleMin-(1-lambdas[i])*doubleMax)*gammas[i];
+            }
+            return val;
+        }
+        constexpr int numberOfKnots() const{
+            return K;
+        }
+        /**
+        @param hash Hash to continue from
+        @return The hash continued over the knots and gammas, see RunMetadata
+        */
+        uint64_t fingerprint(uint64_t hash) const{
+            const double ends[]={minKnot, maxKnot, intercept, slope};
+            hash=hashBytes(ends, sizeof(ends), hash);
+            hash=hashBytes(knots.data(), knots.size()*sizeof(double), hash);
+            return hashBytes(gammas.data(), gammas.size()*sizeof(double), hash);
+        }
+    };
+    /**
+    withSpline picks the FixedSpline specialization matching the number of 
+    knots at model load and hands it to the callback.  Knot counts without a 
+    specialization use the runtime Spline.  The callback must return the 
+    same type for every spline.
+    @param knots_gamma Vector of tuples of knots and gammas
+    @param cb Callback taking the compiled spline
+    @return The result of the callback
+    */
+    template<typename Tuple, typename Callback>
+    auto withSpline(const std::vector<Tuple>& knots_gamma, Callback&& cb){
+        switch(knots_gamma.size()){
+            case 2:
+                return cb(FixedSpline<2>(knots_gamma));
+            case 3:
+                return cb(FixedSpline<3>(knots_gamma));
+            case 4:
+                return cb(FixedSpline<4>(knots_gamma));
+            case 5:
+                return cb(FixedSpline<5>(knots_gamma));
+            case 6:
+                return cb(FixedSpline<6>(knots_gamma));
+            case 7:
+                return cb(FixedSpline<7>(knots_gamma));
+            case 8:
+                return cb(FixedSpline<8>(knots_gamma));
+            default:
+                return cb(Spline(knots_gamma));
+        }
     }
     /**gS is an offset spline*/
-    template<typename T>
-    auto gS(const T& logTimeHorizon, double offset){
-        return cspline(logTimeHorizon)+offset;
+    template<typename S, typename T>
+    auto gS(const S& spline, const T& logTimeHorizon, double offset){
+        return spline(logTimeHorizon)+offset;
+    }
+    /**
+    Computes the linear predictor for a given loan.  Note that the attributes are de-meaned so that the average is zero.  This is to ensure that the spline coefficients from a model with no coefficients is unbiased and can be sloped.
+    @param attributesAndCoefficients Tuples of attribute, attribute mean and coefficient
+    @return The de-meaned linear predictor
+    */
+    template<typename Tuple>
+    double linearPredictor(const std::vector<Tuple>& attributesAndCoefficients){
+        return futilities::sum(attributesAndCoefficients, [&](const auto& attributeAndCoefficient, const auto& index){
+            return (std::get<Attribute>(attributeAndCoefficient)-std::get<AttributeMean>(attributeAndCoefficient))*std::get<Coefficient>(attributeAndCoefficient);
+        });
+    }
+    /**
+    PreparedLoan holds what the PD model needs for a loan.  The linear 
+    predictor is computed once, when the loan is loaded or when the 
+    coefficients change, instead of on every PD evaluation.
+    */
+    struct PreparedLoan{
+        double linearPredictor;
+        double timeOnBooks;
+        double timeRemaining;
+    };
+    template<typename C, typename Tuple>
+    PreparedLoan prepareLoan(const C& timeOnBooks, const C& timeRemaining, const std::vector<Tuple>& attributesAndCoefficients){
+        return PreparedLoan{linearPredictor(attributesAndCoefficients), (double)timeOnBooks, (double)timeRemaining};
+    }
+    /**
+    @param portfolio The portfolio
+    @param loan The index of the loan
+    @param linearPredictors The linear predictors of the portfolio, from Portfolio::linearPredictors
+    @return The prepared loan
+    */
+    inline PreparedLoan prepareLoan(const Portfolio& portfolio, int loan, const std::vector<double>& linearPredictors){
+        return PreparedLoan{linearPredictors[loan], portfolio.getTimeOnBooks(loan), portfolio.getTimeRemaining(loan)};
+    }
+    template<typename C, typename Tuple>
+    std::vector<PreparedLoan> preparePortfolio(const std::vector<C>& timeOnBooks, const std::vector<C>& timeRemaining, const std::vector<std::vector<Tuple> >& attributesAndCoefficients){
+        return futilities::for_each_parallel(attributesAndCoefficients, [&](const auto& attributeAndCoefInstance, const auto& index){
+            return prepareLoan(timeOnBooks[index], timeRemaining[index], attributeAndCoefInstance);
+        });
     }
     /**
-    Function to retrieve PD for a given loan.  Note that the attributes are de-meaned so that the average is zero.  This is to ensure that the spline coefficients from a model with no coefficients is unbiased and can be sloped.
+    Function to retrieve PD for a given loan.
     @param timeHorizon The time horizon 
     @param currentTime The current time
     @param frailty A positive random variable which jointly impacts losses
+    @param linearPredictor The de-meaned linear predictor of the loan
+    @param surv The survival function
     @return Estimate of PD
     */
-    template<typename T, typename C, typename F, typename A, typename Tuple, typename SurvivalFunction>
+    template<typename T, typename C, typename F, typename SurvivalFunction>
+    auto PD(const T& timeHorizon, const C& currentTime, const F& frailty, const double& linearPredictor, const SurvivalFunction& surv){
+        return 1.0-surv(timeHorizon, currentTime, linearPredictor, frailty);
+    }
+    /**
+    Function to retrieve PD for a given loan.  Prefer the overload taking the 
+    linear predictor when the PD is evaluated repeatedly for the same loan.
+    @param timeHorizon The time horizon 
+    @param currentTime The current time
+    @param frailty A positive random variable which jointly impacts losses
+    @param attributesAndCoefficients Tuples of attribute, attribute mean and coefficient
+    @param surv The survival function
+    @return Estimate of PD
+    */
+    template<typename T, typename C, typename F, typename Tuple, typename SurvivalFunction>
     auto PD(const T& timeHorizon, const C& currentTime, const F& frailty, const std::vector<Tuple>& attributesAndCoefficients, const SurvivalFunction& surv){
-        return 1.0-surv(timeHorizon, currentTime, futilities::sum(attributesAndCoefficients, [&](const auto& attributeAndCoefficient, const auto& index){
-            return (attributesAndCoefficients<Attribute>-attributesAndCoefficients<AttributeMean>)*attributesAndCoefficients<Coefficient>;
-        }), frailty);
+        return PD(timeHorizon, currentTime, frailty, linearPredictor(attributesAndCoefficients), surv);
     }
 
     /**
-    function to retrieve Survival probability for odds
+    function to retrieve Survival probability for odds, 
+    S=1/(1+exp(g)) with g the spline plus offset plus log(frailty)
     @param timeHorizon The time horizon
     @param currentTime The current time
     @param offset Some offset to apply to probability 
     (eg seasonality or idiosyncratic variables)
-    @param frailty A positive random variable which jointly impacts losses
+    @param frailty A positive random variable which jointly impacts losses.  
+    It enters g as log(frailty), so a frailty of 1 has no effect.
+    @param spline The compiled spline of the model
     @return Estimate of Survival probability
     */
-    template<typename T, typename C, typename F, typename Offset, typename Tuple>
-    auto SurvivalProbabilityOdds(const T& timeHorizon, const C& currentTime, const Offset& offset, const F& frailty){
-        auto totalOffset=offset+frailty;
-        bool isSGreaterThanZero=currentTime>0;
-        return currentTime>0?(exp(gS(log(s), offset))+1.0)/(exp(gS(log(x), offset))+1.0):1.0/(exp(gS(log(x), offset))+1);
+    template<typename T, typename C, typename F, typename Offset, typename S>
+    auto SurvivalProbabilityOdds(const T& timeHorizon, const C& currentTime, const Offset& offset, const F& frailty, const S& spline){
+        auto totalOffset=offset+log(frailty);
+        return currentTime>0?(exp(gS(spline, log(currentTime), totalOffset))+1.0)/(exp(gS(spline, log(timeHorizon), totalOffset))+1.0):1.0/(exp(gS(spline, log(timeHorizon), totalOffset))+1.0);
     }
     /**
-    function to retrieve Survival probability for proportional hazard
+    function to retrieve Survival probability for proportional hazard, 
+    S=exp(-exp(g)) with g the spline plus offset plus log(frailty)
     @param timeHorizon The time horizon
     @param currentTime The current time
     @param offset Some offset to apply to probability 
     (eg seasonality or idiosyncratic variables)
-    @param frailty A positive random variable which jointly impacts losses
+    @param frailty A positive random variable which jointly impacts losses.  
+    It enters g as log(frailty), so a frailty of 1 has no effect.
+    @param spline The compiled spline of the model
     @return Estimate of Survival probability
     */
-    template<typename T, typename C, typename F, typename Offset, typename Tuple>
-    auto SurvivalProbabilityHazard(const T& timeHorizon, const C& currentTime, const Offset& offset, const F& frailty){
-        auto totalOffset=offset+frailty;
-        bool isSGreaterThanZero=currentTime>0;
-        return currentTime>0?exp(-exp(gS(log(x), offset)))/exp(-exp(gS(log(s), offset))):exp(-exp(gS(log(x), offset)));
+    template<typename T, typename C, typename F, typename Offset, typename S>
+    auto SurvivalProbabilityHazard(const T& timeHorizon, const C& currentTime, const Offset& offset, const F& frailty, const S& spline){
+        auto totalOffset=offset+log(frailty);
+        return currentTime>0?exp(-exp(gS(spline, log(timeHorizon), totalOffset)))/exp(-exp(gS(spline, log(currentTime), totalOffset))):exp(-exp(gS(spline, log(timeHorizon), totalOffset)));
     }
     /**
-    function to retrieve Survival probability for probit
+    function to retrieve Survival probability for probit, 
+    S=Phi(-g) with g the spline plus offset plus log(frailty), so that 
+    a larger g is a larger PD as in the other models
     @param timeHorizon The time horizon
     @param currentTime The current time
     @param offset Some offset to apply to probability 
     (eg seasonality or idiosyncratic variables)
-    @param frailty A positive random variable which jointly impacts losses
+    @param frailty A positive random variable which jointly impacts losses.  
+    It enters g as log(frailty), so a frailty of 1 has no effect.
+    @param spline The compiled spline of the model
     @return Estimate of Survival probability
     */
-    template<typename T, typename C, typename F, typename Offset, typename Tuple>
-    auto SurvivalProbabilityProbit(const T& timeHorizon, const C& currentTime, const Offset& offset, const F& frailty){
-        auto totalOffset=offset+frailty;
-        bool isSGreaterThanZero=currentTime>0;
-        return currentTime>0?(erf(gS(log(x), offset)*isqrt2)*.5+.5)/(erf(gS(log(s), offset)*isqrt2)*.5+.5)/exp(-exp(gS(log(s), offset))):erf(gS(log(x), offset)*isqrt2)*.5+.5;//this is super slow for some reason
+    template<typename T, typename C, typename F, typename Offset, typename S>
+    auto SurvivalProbabilityProbit(const T& timeHorizon, const C& currentTime, const Offset& offset, const F& frailty, const S& spline){
+        auto totalOffset=offset+log(frailty);
+        return currentTime>0?(.5-erf(gS(spline, log(timeHorizon), totalOffset)*isqrt2)*.5)/(.5-erf(gS(spline, log(currentTime), totalOffset)*isqrt2)*.5):.5-erf(gS(spline, log(timeHorizon), totalOffset)*isqrt2)*.5;//this is super slow for some reason
     }
 
-    template<typename T, typename C, typename Surv, typename Tuple>
-    simulatedTimeToDefault(const C& timeOnBooks, const C& timeRemaining, const std::vector<Tuple>& attributesAndCoefficients, const Surv& surv, double frailty, double unif){
-        const double minPD=0;
-        const double maxPD=1;
+    /**
+    survivalLink maps the offset spline g to a survival probability 
+    for the Hazard, Odds and Probit models using the vectorizable 
+    functions in VMath.h
+    @param g The offset spline
+    @return Survival probability
+    */
+    template<int Model>
+    double survivalLink(double g);
+    template<>
+    inline double survivalLink<Hazard>(double g){
+        return vmath::exp(-vmath::exp(g));
+    }
+    template<>
+    inline double survivalLink<Odds>(double g){
+        return 1.0/(vmath::exp(g)+1.0);
+    }
+    template<>
+    inline double survivalLink<Probit>(double g){
+        return .5*vmath::erfc(g*isqrt2);
+    }
+    /**
+    survivalLinkExact is survivalLink computed with the C library to full 
+    double precision, for the scalar paths (ConditionalSurvival and the 
+    root finds built on it).  survivalLink is kept for the batch kernels, 
+    where vectorizing matters more than the last digits.
+    @param g The offset spline
+    @return Survival probability
+    */
+    template<int Model>
+    double survivalLinkExact(double g);
+    template<>
+    inline double survivalLinkExact<Hazard>(double g){
+        return std::exp(-std::exp(g));
+    }
+    template<>
+    inline double survivalLinkExact<Odds>(double g){
+        return 1.0/(std::exp(g)+1.0);
+    }
+    template<>
+    inline double survivalLinkExact<Probit>(double g){
+        return .5*std::erfc(g*isqrt2);
+    }
+    /**splineBatch evaluates any compiled spline over n log times*/
+    template<typename S>
+    void splineBatch(const S& spline, const double* x, double* out, int n){
+        for(int i=0; i<n; ++i){
+            out[i]=spline(x[i]);
+        }
+    }
+    inline void splineBatch(const Spline& spline, const double* x, double* out, int n){
+        spline.batch(x, out, n);
+    }
+    /**
+    function to retrieve Survival probabilities for a whole portfolio in one pass.  
+    Each step (log, spline, link) runs over the full array so that it vectorizes.  
+    The spline step picks its instruction set at run time (see Spline::batch); 
+    the log and link loops are vectorized by the compiler for the instruction 
+    set the translation unit targets, which is SSE2 on x64 unless eg 
+    /arch:AVX2 or -mavx2 is given.  
+    Errors are those of VMath.h: about 1e-15 relative for Hazard and Odds and 
+    1.2e-7 relative for each Probit survival, so up to 2.4e-7 for the 
+    conditional survival, which is a ratio of two.  A horizon of zero or less, 
+    eg for a new loan looked at today, has survival one rather than the log 
+    of zero being taken.
+    @param timeHorizon The time horizons
+    @param currentTime The current times (zero for unconditional survival)
+    @param offset The offsets for each loan
+    @param frailty A positive random variable which jointly impacts losses
+    @param spline The compiled spline of the model
+    @return Estimates of Survival probability for each loan
+    */
+    template<int Model, typename F, typename S>
+    std::vector<double> SurvivalProbabilityBatch(const std::vector<double>& timeHorizon, const std::vector<double>& currentTime, const std::vector<double>& offset, const F& frailty, const S& spline){
+        const int n=timeHorizon.size();
+        const double logFrailty=log(frailty);
+        std::vector<double> survival(n);
+        std::vector<double> conditional(n);
+        for(int i=0; i<n; ++i){
+            survival[i]=timeHorizon[i]>0?timeHorizon[i]:1.0;//as for the current time below
+        }
+        vmath::log(survival.data(), survival.data(), n);
+        splineBatch(spline, survival.data(), survival.data(), n);
+        for(int i=0; i<n; ++i){
+            conditional[i]=currentTime[i]>0?currentTime[i]:1.0;//log(1) is harmless, the result is discarded below
+        }
+        vmath::log(conditional.data(), conditional.data(), n);
+        splineBatch(spline, conditional.data(), conditional.data(), n);
+        for(int i=0; i<n; ++i){
+            const double totalOffset=offset[i]+logFrailty;
+            const double denominator=survivalLink<Model>(conditional[i]+totalOffset);
+            survival[i]=timeHorizon[i]>0?survivalLink<Model>(survival[i]+totalOffset)/(currentTime[i]>0?denominator:1.0):1.0;
+        }
+        return survival;
+    }
+    template<typename F, typename S>
+    std::vector<double> SurvivalProbabilityOddsBatch(const std::vector<double>& timeHorizon, const std::vector<double>& currentTime, const std::vector<double>& offset, const F& frailty, const S& spline){
+        return SurvivalProbabilityBatch<Odds>(timeHorizon, currentTime, offset, frailty, spline);
+    }
+    template<typename F, typename S>
+    std::vector<double> SurvivalProbabilityHazardBatch(const std::vector<double>& timeHorizon, const std::vector<double>& currentTime, const std::vector<double>& offset, const F& frailty, const S& spline){
+        return SurvivalProbabilityBatch<Hazard>(timeHorizon, currentTime, offset, frailty, spline);
+    }
+    template<typename F, typename S>
+    std::vector<double> SurvivalProbabilityProbitBatch(const std::vector<double>& timeHorizon, const std::vector<double>& currentTime, const std::vector<double>& offset, const F& frailty, const S& spline){
+        return SurvivalProbabilityBatch<Probit>(timeHorizon, currentTime, offset, frailty, spline);
+    }
+
+    /**
+    ConditionalSurvival holds a loan's survival function conditional on 
+    surviving to the current time, for one frailty draw.  S(currentTime) 
+    is computed once on construction and reused for every horizon, so 
+    root finding and PD curves only evaluate the spline at the horizon.  
+    The link is survivalLinkExact, so survival is accurate to double 
+    precision for every model.
+    */
+    template<int Model, typename S>
+    class ConditionalSurvival{
+    private:
+        const S& spline;
+        double currentTime;
+        double totalOffset;
+        double survivalAtCurrent;
+    public:
+        /**
+        @param spline_ The compiled spline of the model
+        @param currentTime_ The current time
+        @param offset The linear predictor of the loan
+        @param frailty A positive random variable which jointly impacts losses
+        */
+        ConditionalSurvival(const S& spline_, double currentTime_, double offset, double frailty):spline(spline_), currentTime(currentTime_){
+            totalOffset=offset+log(frailty);
+            survivalAtCurrent=currentTime>0?survivalLinkExact<Model>(spline(log(currentTime))+totalOffset):1.0;
+        }
+        /**
+        @param timeHorizon The time horizon
+        @return Survival probability to the time horizon given survival to the current time
+        */
+        double operator()(double timeHorizon) const{
+            return survivalLinkExact<Model>(spline(log(timeHorizon))+totalOffset)/survivalAtCurrent;
+        }
+        /**
+        @param timeHorizon The time horizon
+        @return PD to the time horizon given survival to the current time
+        */
+        double PD(double timeHorizon) const{
+            return 1.0-(*this)(timeHorizon);
+        }
+        /**
+        @param timeHorizons Several time horizons
+        @return PD to each time horizon given survival to the current time
+        */
+        std::vector<double> PD(const std::vector<double>& timeHorizons) const{
+            std::vector<double> pds(timeHorizons.size());
+            for(int i=0; i<(int)timeHorizons.size(); ++i){
+                pds[i]=PD(timeHorizons[i]);
+            }
+            return pds;
+        }
+        const S& getSpline() const{
+            return spline;
+        }
+        double getCurrentTime() const{
+            return currentTime;
+        }
+        double getTotalOffset() const{
+            return totalOffset;
+        }
+        double getSurvivalAtCurrent() const{
+            return survivalAtCurrent;
+        }
+    };
+    template<int Model, typename S>
+    ConditionalSurvival<Model, S> makeConditionalSurvival(const S& spline, const PreparedLoan& loan, double frailty){
+        return ConditionalSurvival<Model, S>(spline, loan.timeOnBooks, loan.linearPredictor, frailty);
+    }
+    /**
+    Function to retrieve PDs for a loan at several time horizons, 
+    computing the survival to the current time only once.
+    @param timeHorizons The time horizons
+    @param loan The prepared loan
+    @param frailty A positive random variable which jointly impacts losses
+    @param spline The compiled spline of the model
+    @return Estimates of PD for each time horizon
+    */
+    template<int Model, typename S>
+    std::vector<double> PDCurve(const std::vector<double>& timeHorizons, const PreparedLoan& loan, double frailty, const S& spline){
+        return makeConditionalSurvival<Model>(spline, loan, frailty).PD(timeHorizons);
+    }
+
+    /**
+    inverseNormal computes the standard normal quantile using the rational 
+    approximation of Acklam followed by one Halley step, which gives 
+    full double precision.
+    @param p Probability in (0, 1)
+    @return The quantile
+    */
+    inline double inverseNormal(double p){
+        const double a[]={-3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+        const double b[]={-5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01};
+        const double c[]={-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+        const double d[]={7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00};
+        const double pLow=.02425;
+        double x;
+        if(p<pLow){
+            const double q=sqrt(-2*log(p));
+            x=(((((c[0]*q+c[1])*q+c[2])*q+c[3])*q+c[4])*q+c[5])/((((d[0]*q+d[1])*q+d[2])*q+d[3])*q+1);
+        }
+        else if(p>1-pLow){
+            const double q=sqrt(-2*log(1-p));
+            x=-(((((c[0]*q+c[1])*q+c[2])*q+c[3])*q+c[4])*q+c[5])/((((d[0]*q+d[1])*q+d[2])*q+d[3])*q+1);
+        }
+        else{
+            const double q=p-.5;
+            const double r=q*q;
+            x=(((((a[0]*r+a[1])*r+a[2])*r+a[3])*r+a[4])*r+a[5])*q/(((((b[0]*r+b[1])*r+b[2])*r+b[3])*r+b[4])*r+1);
+        }
+        const double e=.5*erfc(-x*isqrt2)-p;
+        const double u=e*2.5066282746310002*exp(x*x*.5);//sqrt(2pi)
+        return x-u/(1+x*u*.5);
+    }
+    /**
+    inverseSurvivalLink maps a survival probability back to the offset 
+    spline g for the Hazard, Odds and Probit models.  This is the inverse 
+    of survivalLink.
+    @param survival Survival probability in (0, 1)
+    @return The offset spline g
+    */
+    template<int Model>
+    double inverseSurvivalLink(double survival);
+    template<>
+    inline double inverseSurvivalLink<Hazard>(double survival){
+        return log(-log(survival));
+    }
+    template<>
+    inline double inverseSurvivalLink<Odds>(double survival){
+        return log((1.0-survival)/survival);
+    }
+    template<>
+    inline double inverseSurvivalLink<Probit>(double survival){
+        return -inverseNormal(survival);
+    }
+    /**
+    Simulates the time to default for a loan by bisection on the PD.
+    @param loan The prepared loan
+    @param surv The survival function
+    @param frailty A positive random variable which jointly impacts losses
+    @param unif A uniform random variable
+    @return Time after timeOnBooks at which the loan defaults, or a 
+    very large time if it does not default before maturity
+    */
+    template<typename Surv>
+    double simulatedTimeToDefault(const PreparedLoan& loan, const Surv& surv, double frailty, double unif){
+        const double accuracy=.00001;
+        const double maxTime=100000.0; //this is something so large that it essentially means the loan will never default
+        return PD(loan.timeOnBooks+loan.timeRemaining, loan.timeOnBooks, frailty, loan.linearPredictor, surv)<unif?maxTime:newton::bisect([&](const auto& theta){
+            return PD(loan.timeOnBooks+theta, loan.timeOnBooks, frailty, loan.linearPredictor, surv)-unif;
+        }, 0.0, loan.timeRemaining, accuracy, accuracy);
+    }
+    /**
+    Simulates the time to default for a loan by bisection on the PD, 
+    with the survival to the current time computed once.
+    @param survival The loan's conditional survival for this frailty draw
+    @param timeRemaining The time until the loan matures
+    @param unif A uniform random variable
+    @return Time after the current time at which the loan defaults, or a 
+    very large time if it does not default before maturity
+    */
+    template<int Model, typename S>
+    double simulatedTimeToDefault(const ConditionalSurvival<Model, S>& survival, double timeRemaining, double unif){
         const double accuracy=.00001;
         const double maxTime=100000.0; //this is something so large that it essentially means the loan will never default
-        return (PD(timeOnBooks+timeRemaining, timeOnBooks, frailty, attributesAndCoefficients, surv)-unif<0):defaultMaxTime:newton::bisect([&](const auto& theta){
-            return PD(timeOnBooks+theta, timeOnBooks, frailty, attributesAndCoefficients, surv)-unif;
-        }, minPD, maxPD, accuracy, accuracy);
+        const double timeOnBooks=survival.getCurrentTime();
+        return survival.PD(timeOnBooks+timeRemaining)<unif?maxTime:newton::bisect([&](const auto& theta){
+            return survival.PD(timeOnBooks+theta)-unif;
+        }, 0.0, timeRemaining, accuracy, accuracy);
+    }
+    template<int Model, typename S>
+    double simulatedTimeToDefault(const PreparedLoan& loan, const S& spline, double frailty, double unif){
+        return simulatedTimeToDefault(makeConditionalSurvival<Model>(spline, loan, frailty), loan.timeRemaining, unif);
+    }
+    template<typename C, typename Surv, typename Tuple>
+    double simulatedTimeToDefault(const C& timeOnBooks, const C& timeRemaining, const std::vector<Tuple>& attributesAndCoefficients, const Surv& surv, double frailty, double unif){
+        return simulatedTimeToDefault(prepareLoan(timeOnBooks, timeRemaining, attributesAndCoefficients), surv, frailty, unif);
+    }
+    /**
+    Simulates the time to default for a loan by inverting the survival 
+    function.  The target value of the spline is found in closed form 
+    from the link function and then the spline is inverted by Newton's 
+    method safeguarded with bisection, using the spline derivative.  
+    This typically takes 3 or 4 Newton steps, each evaluating the spline 
+    and its derivative once, instead of the ~20 PD evaluations of 
+    simulatedTimeToDefault.  A Newton step that lands on the edge of 
+    the bracket is kept, so convergence is not undone by bisection.
+    @param survival The loan's conditional survival for this frailty draw
+    @param timeRemaining The time until the loan matures
+    @param unif A uniform random variable
+    @return Time after the current time at which the loan defaults, or a 
+    very large time if it does not default before maturity
+    */
+    template<int Model, typename S>
+    double simulatedTimeToDefaultInverse(const ConditionalSurvival<Model, S>& survival, double timeRemaining, double unif){
+        const double accuracy=1e-10;//in log time
+        const int maxIterations=50;
+        const double maxTime=100000.0; //this is something so large that it essentially means the loan will never default
+        const S& spline=survival.getSpline();
+        const double timeOnBooks=survival.getCurrentTime();
+        const double hi0=log(timeOnBooks+timeRemaining);
+        if(survival.PD(timeOnBooks+timeRemaining)<unif){
+            return maxTime;
+        }
+        const double target=inverseSurvivalLink<Model>((1.0-unif)*survival.getSurvivalAtCurrent())-survival.getTotalOffset();
+        double hi=hi0;
+        double lo=timeOnBooks>0?log(timeOnBooks):hi-1.0;
+        double step=1.0;
+        for(int i=0; i<maxIterations&&timeOnBooks<=0&&spline(lo)>target; ++i){ //the spline is linear below the first knot, so this ends quickly
+            hi=lo;
+            step*=2;
+            lo-=step;
+        }
+        double x=.5*(lo+hi);
+        for(int i=0; i<maxIterations; ++i){
+            const double f=spline(x)-target;
+            if(f==0){
+                break;
+            }
+            const double derivative=spline.derivative(x);
+            const double step=f/derivative;
+            if(derivative>0&&std::abs(step)<accuracy){ //converged, whether or not the step lands on the bracket
+                x-=step;
+                break;
+            }
+            if(f>0){
+                hi=x;
+            }
+            else{
+                lo=x;
+            }
+            double next=x-step;
+            if(!(derivative>0)||next<lo-accuracy||next>hi+accuracy){
+                next=.5*(lo+hi);
+            }
+            x=next;
+            if(hi-lo<accuracy){
+                break;
+            }
+        }
+        return exp(x)-timeOnBooks;
+    }
+    template<int Model, typename S>
+    double simulatedTimeToDefaultInverse(double timeOnBooks, double timeRemaining, double offset, const S& spline, double frailty, double unif){
+        return simulatedTimeToDefaultInverse(ConditionalSurvival<Model, S>(spline, timeOnBooks, offset, frailty), timeRemaining, unif);
+    }
+    template<int Model, typename S>
+    double simulatedTimeToDefaultInverse(const PreparedLoan& loan, const S& spline, double frailty, double unif){
+        return simulatedTimeToDefaultInverse<Model>(loan.timeOnBooks, loan.timeRemaining, loan.linearPredictor, spline, frailty, unif);
     }
 
-    template<typename T, typename C, typename F, typename A, typename Tuple, typename U, typename SurvivalFunction>
-    void simulatePortfolio(int n, const std::vector<C>& timeOnBooks, const std::vector<C>& timeRemaining,const F& frailtyGenerator, const U& unifRandGenerator, const std::vector<std::vector<Tuple> >& attributesAndCoefficients,  SurvivalFunction& surv){
-        return futilities::for_each_parallel(0, n, [&](const auto& index){
-            return futilities::for_each_parallel(attributesAndCoefficients, [&](const auto& attributeAndCoefInstance, const auto& portIndex){
-                return simulatedTimeToDefault(timeOnBooks[index], timeRemaining[index],attributeAndCoefInstance, surv, frailtyGenerator(), unifRandGenerator());
+    /**
+    Simulates n scenarios of default times for every loan in the portfolio.  
+    The (scenario, block of loans) space is split into flat tasks which run 
+    on the work stealing pool, so there is no nested parallelism and loans 
+    with slow root finds do not hold up a whole scenario.  The frailties are 
+    drawn up front, once per scenario, in scenario order.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw
+    @param simulateLoan Function taking a PreparedLoan, a frailty, the scenario 
+    index and the loan index and returning the time to default.  This is 
+    called concurrently.
+    @param pool The pool to run on
+    @return Default times for each scenario and loan
+    */
+    template<typename F, typename SimulateLoan>
+    std::vector<std::vector<double> > simulatePortfolioTiled(int n, const Portfolio& portfolio, const F& frailtyGenerator, const SimulateLoan& simulateLoan, WorkStealingPool& pool=defaultPool()){
+        const int blockSize=1024;
+        const int numLoans=portfolio.size();
+        const int numBlocks=(numLoans+blockSize-1)/blockSize;
+        const auto linearPredictors=portfolio.linearPredictors();
+        std::vector<double> frailties(n);
+        for(int i=0; i<n; ++i){
+            frailties[i]=frailtyGenerator();
+        }
+        std::vector<std::vector<double> > defaultTimes(n, std::vector<double>(numLoans));
+        pool.parallelFor(n*numBlocks, [&](int task){
+            const int scenario=task/numBlocks;
+            const int begin=(task%numBlocks)*blockSize;
+            const int end=std::min(begin+blockSize, numLoans);
+            for(int i=begin; i<end; ++i){
+                defaultTimes[scenario][i]=simulateLoan(prepareLoan(portfolio, i, linearPredictors), frailties[scenario], scenario, i);
+            }
+        });
+        return defaultTimes;
+    }
+    /**
+    Simulates n scenarios of default times for every loan in the portfolio.  
+    The linear predictors are computed once up front.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario
+    @param unifRandGenerator Thread safe function returning a uniform draw, called once per loan and scenario
+    @param surv The survival function
+    @return Default times for each scenario and loan
+    */
+    template<typename F, typename U, typename SurvivalFunction>
+    auto simulatePortfolio(int n, const Portfolio& portfolio, const F& frailtyGenerator, const U& unifRandGenerator, const SurvivalFunction& surv){
+        return simulatePortfolioTiled(n, portfolio, frailtyGenerator, [&](const PreparedLoan& loan, double frailty, int, int){
+            return simulatedTimeToDefault(loan, surv, frailty, unifRandGenerator());
+        });
+    }
+    /**
+    Simulates n scenarios of default times for every loan in the portfolio 
+    using simulatedTimeToDefaultInverse.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario
+    @param unifRandGenerator Thread safe function returning a uniform draw, called once per loan and scenario
+    @param spline The compiled spline of the model
+    @return Default times for each scenario and loan
+    */
+    template<int Model, typename F, typename U, typename S>
+    auto simulatePortfolio(int n, const Portfolio& portfolio, const F& frailtyGenerator, const U& unifRandGenerator, const S& spline){
+        return simulatePortfolioTiled(n, portfolio, frailtyGenerator, [&](const PreparedLoan& loan, double frailty, int, int){
+            return simulatedTimeToDefaultInverse<Model>(loan, spline, frailty, unifRandGenerator());
+        });
+    }
+    /**
+    @param spline The compiled spline of the model
+    @param rng The counter based generator
+    @return Function simulating a loan's time to default by 
+    simulatedTimeToDefaultInverse with the uniform 
+    rng.getUnif(scenario, loan), for simulatePortfolioTiled and 
+    simulatePortfolioLossesTiled; it refers to spline and rng
+    */
+    template<int Model, typename S>
+    auto counterLoanSimulator(const S& spline, const RCounter& rng){
+        return [&spline, &rng](const PreparedLoan& loan, double frailty, int scenario, int loanIndex){
+            return simulatedTimeToDefaultInverse<Model>(loan, spline, frailty, rng.getUnif(scenario, loanIndex));
+        };
+    }
+    /**
+    Simulates n scenarios of default times for every loan in the portfolio 
+    using simulatedTimeToDefaultInverse and the counter based generator.  
+    The uniform for a loan in a scenario is rng.getUnif(scenario, loan), 
+    so results are identical for any number of threads.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario in order
+    @param rng The counter based generator
+    @param spline The compiled spline of the model
+    @return Default times for each scenario and loan
+    */
+    template<int Model, typename F, typename S>
+    auto simulatePortfolio(int n, const Portfolio& portfolio, const F& frailtyGenerator, const RCounter& rng, const S& spline){
+        return simulatePortfolioTiled(n, portfolio, frailtyGenerator, counterLoanSimulator<Model>(spline, rng));
+    }
+    /**
+    Number of blocks each scenario's loans are split into.  This depends 
+    only on the total number of scenarios and loans, so the sums, and 
+    hence the results, do not depend on the number of threads or on how 
+    the scenarios are split into batches.
+    */
+    inline int lossBlocks(int n, int numLoans){
+        const int blockSize=1024;
+        const int minTasks=256;
+        return std::max(1, std::min((numLoans+blockSize-1)/blockSize, (minTasks+n-1)/std::max(n, 1)));
+    }
+    /**
+    Simulates the portfolio losses of the scenarios in [first, last).  Each 
+    task simulates a block of loans for one scenario and keeps only the 
+    block's loss, default count and monthly buckets; the blocks are then 
+    added up in loan order.
+    @param first The first scenario
+    @param last One past the last scenario
+    @param numBlocks Number of blocks per scenario, from lossBlocks
+    @param portfolio The loans
+    @param linearPredictors The linear predictor of each loan
+    @param frailties The frailty of every scenario
+    @param simulateLoan Function taking a PreparedLoan, a frailty, the scenario 
+    index and the loan index and returning the time to default
+    @param severity Function taking the loan index, the time on books at 
+    default and the scenario index and returning the dollar loss
+    @param numMonths Number of monthly loss buckets to keep
+    @param pool The pool to run on
+    @param accumulators If not null, each loan's loss and loss times the 
+    portfolio loss are added to these
+    @param tail If not null, scenarios that enter the tail are added with 
+    their loan losses
+    @return Loss, number of defaults and optionally loss by month for each scenario in the range
+    */
+    template<typename SimulateLoan, typename Severity>
+    ScenarioLosses simulateLossRange(int first, int last, int numBlocks, const Portfolio& portfolio, const std::vector<double>& linearPredictors, const std::vector<double>& frailties, const SimulateLoan& simulateLoan, const Severity& severity, int numMonths, WorkStealingPool& pool, LoanAccumulators* accumulators=nullptr, TailContributions* tail=nullptr){
+        const int n=last-first;
+        const int numLoans=portfolio.size();
+        const int loansPerBlock=(numLoans+numBlocks-1)/numBlocks;
+        std::vector<double> blockLosses(n*numBlocks, 0.0);
+        std::vector<int> blockDefaults(n*numBlocks, 0);
+        std::vector<double> blockLossByMonth(n*numBlocks*numMonths, 0.0);
+        const bool keepDefaultLosses=accumulators||tail;
+        std::vector<std::vector<std::pair<int, double> > > blockDefaultLosses(keepDefaultLosses?n*numBlocks:0);
+        pool.parallelFor(n*numBlocks, [&](int task){
+            const int scenario=first+task/numBlocks;
+            const int begin=(task%numBlocks)*loansPerBlock;
+            const int end=std::min(begin+loansPerBlock, numLoans);
+            double loss=0;
+            int defaults=0;
+            double* byMonth=blockLossByMonth.data()+task*numMonths;
+            for(int i=begin; i<end; ++i){
+                const PreparedLoan loan=prepareLoan(portfolio, i, linearPredictors);
+                const double timeToDefault=simulateLoan(loan, frailties[scenario], scenario, i);
+                if(timeToDefault<=loan.timeRemaining){
+                    const double loanLoss=severity(i, loan.timeOnBooks+timeToDefault, scenario);
+                    loss+=loanLoss;
+                    ++defaults;
+                    const int month=(int)timeToDefault;
+                    if(month<numMonths){
+                        byMonth[month]+=loanLoss;
+                    }
+                    if(keepDefaultLosses){
+                        blockDefaultLosses[task].emplace_back(i, loanLoss);
+                    }
+                }
+            }
+            blockLosses[task]=loss;
+            blockDefaults[task]=defaults;
+        });
+        ScenarioLosses result;
+        result.losses.resize(n, 0.0);
+        result.numDefaults.resize(n, 0);
+        if(numMonths>0){
+            result.lossByMonth.resize(n, std::vector<double>(numMonths, 0.0));
+        }
+        for(int scenario=0; scenario<n; ++scenario){
+            for(int block=0; block<numBlocks; ++block){
+                const int task=scenario*numBlocks+block;
+                result.losses[scenario]+=blockLosses[task];
+                result.numDefaults[scenario]+=blockDefaults[task];
+                for(int month=0; month<numMonths; ++month){
+                    result.lossByMonth[scenario][month]+=blockLossByMonth[task*numMonths+month];
+                }
+            }
+        }
+        if(accumulators){
+            accumulators->resize(numLoans);
+            pool.parallelFor(numBlocks, [&](int block){//each block owns its loans, and exact sums do not depend on order
+                for(int scenario=0; scenario<n; ++scenario){
+                    for(const auto& defaultLoss:blockDefaultLosses[scenario*numBlocks+block]){
+                        accumulators->loss[defaultLoss.first].add(defaultLoss.second);
+                        accumulators->lossTimesPortfolio[defaultLoss.first].add(defaultLoss.second*result.losses[scenario]);
+                    }
+                }
             });
+        }
+        if(tail){
+            for(int scenario=0; scenario<n; ++scenario){
+                if(tail->isCandidate(result.losses[scenario], first+scenario)){
+                    std::vector<std::pair<int, double> > loanLosses;
+                    for(int block=0; block<numBlocks; ++block){
+                        const auto& defaultLosses=blockDefaultLosses[scenario*numBlocks+block];
+                        loanLosses.insert(loanLosses.end(), defaultLosses.begin(), defaultLosses.end());
+                    }
+                    tail->add(result.losses[scenario], first+scenario, std::move(loanLosses));
+                }
+            }
+        }
+        return result;
+    }
+    /**
+    Simulates n scenarios of portfolio losses without storing a default 
+    time for every loan.  Memory is O(n) rather than O(n*loans).
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw
+    @param simulateLoan Function taking a PreparedLoan, a frailty, the scenario 
+    index and the loan index and returning the time to default.  This is 
+    called concurrently.
+    @param severity Function taking the loan index, the time on books at 
+    default and the scenario index and returning the dollar loss given 
+    default, eg from EGD::predict or LGD::predictAndSimulate.  This is 
+    called concurrently.
+    @param numMonths Number of monthly loss buckets to keep; defaults past 
+    the last bucket still count towards the totals
+    @param pool The pool to run on
+    @param tail If not null, the tail scenarios and their loan losses are 
+    kept here for expected shortfall contributions.  Scenarios are then 
+    simulated in batches of about the tail size, so the loan losses held 
+    at any time stay O(loans*tail size); the results are unchanged.
+    @return Loss, number of defaults and optionally loss by month for each scenario
+    */
+    template<typename F, typename SimulateLoan, typename Severity>
+    ScenarioLosses simulatePortfolioLossesTiled(int n, const Portfolio& portfolio, const F& frailtyGenerator, const SimulateLoan& simulateLoan, const Severity& severity, int numMonths=0, WorkStealingPool& pool=defaultPool(), TailContributions* tail=nullptr){
+        std::vector<double> frailties(n);
+        for(int i=0; i<n; ++i){
+            frailties[i]=frailtyGenerator();
+        }
+        const int numBlocks=lossBlocks(n, portfolio.size());
+        const auto linearPredictors=portfolio.linearPredictors();
+        if(!tail){
+            return simulateLossRange(0, n, numBlocks, portfolio, linearPredictors, frailties, simulateLoan, severity, numMonths, pool);
+        }
+        const int minBatch=256;
+        const int batchSize=std::max(tail->getTailSize(), minBatch);
+        ScenarioLosses result;
+        for(int first=0; first<n; first+=batchSize){
+            append(result, simulateLossRange(first, std::min(first+batchSize, n), numBlocks, portfolio, linearPredictors, frailties, simulateLoan, severity, numMonths, pool, nullptr, tail));
+        }
+        return result;
+    }
+    /**
+    @param portfolio The loans
+    @param hash Hash to continue from
+    @return The hash continued over the loans, coefficients and attribute 
+    means, see RunMetadata
+    */
+    inline uint64_t fingerprint(const Portfolio& portfolio, uint64_t hash){
+        for(int j=0; j<portfolio.getNumAttributes(); ++j){
+            hash=hashBytes(portfolio.getAttributeColumn(j), portfolio.size()*sizeof(double), hash);
+        }
+        hash=hashBytes(portfolio.getCoefficients().data(), portfolio.getCoefficients().size()*sizeof(double), hash);
+        hash=hashBytes(portfolio.getAttributeMeans().data(), portfolio.getAttributeMeans().size()*sizeof(double), hash);
+        for(int i=0; i<portfolio.size(); ++i){
+            const double times[]={portfolio.getTimeOnBooks(i), portfolio.getTimeRemaining(i)};
+            hash=hashBytes(times, sizeof(times), hash);
+        }
+        return hash;
+    }
+    /**
+    Fingerprint of the inputs of a counter based run, see RunMetadata
+    @param runId Identifies the inputs that cannot be hashed
+    @param spline The compiled spline of the model
+    @return The hash of runId and the spline
+    */
+    template<typename S>
+    uint64_t runFingerprint(uint64_t runId, const S& spline){
+        return spline.fingerprint(hashBytes(&runId, sizeof(runId)));
+    }
+    /**
+    Simulates the portfolio losses of the scenarios in 
+    [metadata.firstScenario, metadata.lastScenario) of an n scenario run, 
+    writing the completed scenarios to a file every scenariosPerCheckpoint 
+    scenarios.  If the file holds a checkpoint of the same run it is 
+    resumed from there; otherwise the run starts from scratch.  The 
+    frailty generator is replayed from the start and scenarios are blocked 
+    by n exactly as in simulatePortfolioLossesTiled, so a resumed run, or 
+    a range of a run, gives the same results as an uninterrupted run of 
+    every scenario.  The file starts with the scenarios completed when 
+    the run starts, rewritten once, and each checkpoint then appends only 
+    its new scenarios.  With metadata.hasLoanAccumulators set, the loan 
+    accumulators cover every scenario so far, so each checkpoint instead 
+    rewrites the whole file atomically with writeLosses.
+    @param n Number of scenarios in the whole run
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per 
+    scenario in order up to the last scenario of the range
+    @param simulateLoan Function returning the time to default; must depend 
+    only on its arguments, eg through RCounter
+    @param severity Function returning the dollar loss given default
+    @param numMonths Number of monthly loss buckets to keep
+    @param metadata Identifies the run; the seed, fingerprint, model, range 
+    and hasLoanAccumulators are read, and the portfolio is added to the 
+    fingerprint here
+    @param checkpointFile The file holding the checkpoint
+    @param scenariosPerCheckpoint Number of scenarios between checkpoints.  
+    Without loan accumulators the total written is O(scenarios); with 
+    them each checkpoint writes O(scenarios+loans) bytes, and the file 
+    stays that size.
+    @param accumulators Set to the loan accumulators of the range when 
+    metadata.hasLoanAccumulators is set
+    @param pool The pool to run on
+    @return Loss, number of defaults and optionally loss by month for each scenario in the range
+    @throws std::runtime_error if a checkpoint cannot be written
+    */
+    template<typename F, typename SimulateLoan, typename Severity>
+    ScenarioLosses simulatePortfolioLossesCheckpointed(int n, const Portfolio& portfolio, const F& frailtyGenerator, const SimulateLoan& simulateLoan, const Severity& severity, int numMonths, RunMetadata metadata, const std::string& checkpointFile, int scenariosPerCheckpoint, LoanAccumulators* accumulators=nullptr, WorkStealingPool& pool=defaultPool()){
+        metadata.numScenarios=n;
+        metadata.numLoans=portfolio.size();
+        metadata.numMonths=numMonths;
+        metadata.fingerprint=fingerprint(portfolio, metadata.fingerprint);
+        LoanAccumulators localAccumulators;
+        LoanAccumulators& rangeAccumulators=accumulators?*accumulators:localAccumulators;
+        ScenarioLosses result;
+        RunMetadata stored;
+        if(!(readLosses(checkpointFile, stored, result, &rangeAccumulators)&&metadata.isSameRun(stored))){
+            result=ScenarioLosses();
+            rangeAccumulators=LoanAccumulators();
+        }
+        if(metadata.hasLoanAccumulators){
+            rangeAccumulators.resize(portfolio.size());
+        }
+        metadata.completedScenarios=result.losses.size();
+        if(!writeLosses(checkpointFile, metadata, result, &rangeAccumulators)){//drops any partial block before appending
+            throw std::runtime_error("could not write checkpoint "+checkpointFile);
+        }
+        std::vector<double> frailties(metadata.lastScenario);
+        for(int i=0; i<metadata.lastScenario; ++i){
+            frailties[i]=frailtyGenerator();
+        }
+        const int numBlocks=lossBlocks(n, portfolio.size());
+        const auto linearPredictors=portfolio.linearPredictors();
+        for(int first=metadata.firstScenario+metadata.completedScenarios; first<metadata.lastScenario; first+=scenariosPerCheckpoint){
+            const int last=std::min(first+scenariosPerCheckpoint, metadata.lastScenario);
+            append(result, simulateLossRange(first, last, numBlocks, portfolio, linearPredictors, frailties, simulateLoan, severity, numMonths, pool, metadata.hasLoanAccumulators?&rangeAccumulators:nullptr));
+            const int written=metadata.completedScenarios;
+            metadata.completedScenarios=last-metadata.firstScenario;
+            const bool isWritten=metadata.hasLoanAccumulators?writeLosses(checkpointFile, metadata, result, &rangeAccumulators):appendLosses(checkpointFile, metadata, result, written);
+            if(!isWritten){
+                throw std::runtime_error("could not write checkpoint "+checkpointFile);
+            }
+        }
+        return result;
+    }
+    /**
+    Splits n scenarios into numShards disjoint, contiguous ranges of 
+    nearly equal size.
+    @param shard The index of the shard
+    @param numShards The number of shards
+    @param n Number of scenarios
+    @param first Set to the first scenario of the shard
+    @param last Set to one past the last scenario of the shard
+    */
+    inline void shardRange(int shard, int numShards, int n, int& first, int& last){
+        first=(int)((long long)n*shard/numShards);
+        last=(int)((long long)n*(shard+1)/numShards);
+    }
+    /**
+    Simulates n scenarios of portfolio losses using 
+    simulatedTimeToDefaultInverse and the counter based generator.  The 
+    uniform for a loan in a scenario is rng.getUnif(scenario, loan), so 
+    results are identical for any number of threads.  The losses can be 
+    passed straight to RiskContribution.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario in order
+    @param rng The counter based generator
+    @param spline The compiled spline of the model
+    @param severity Thread safe function taking the loan index, the time on 
+    books at default and the scenario index and returning the dollar loss
+    @param numMonths Number of monthly loss buckets to keep
+    @return Loss, number of defaults and optionally loss by month for each scenario
+    */
+    template<int Model, typename F, typename S, typename Severity>
+    ScenarioLosses simulatePortfolioLosses(int n, const Portfolio& portfolio, const F& frailtyGenerator, const RCounter& rng, const S& spline, const Severity& severity, int numMonths=0){
+        return simulatePortfolioLossesTiled(n, portfolio, frailtyGenerator, counterLoanSimulator<Model>(spline, rng), severity, numMonths);
+    }
+    /**
+    Simulates n scenarios of portfolio losses using the counter based 
+    generator, as above, and keeps the tail scenarios for expected 
+    shortfall contributions.  With tail sized by 
+    TailContributions::tailSizeFor(n, q), tail.getContributions() are the 
+    Euler contributions of each loan to 
+    RiskContribution<Upper>::getEShortfall(q) of the losses.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario in order
+    @param rng The counter based generator
+    @param spline The compiled spline of the model
+    @param severity Thread safe function taking the loan index, the time on 
+    books at default and the scenario index and returning the dollar loss
+    @param numMonths Number of monthly loss buckets to keep
+    @param tail Receives the tail scenarios and their loan losses
+    @return Loss, number of defaults and optionally loss by month for each scenario
+    */
+    template<int Model, typename F, typename S, typename Severity>
+    ScenarioLosses simulatePortfolioLosses(int n, const Portfolio& portfolio, const F& frailtyGenerator, const RCounter& rng, const S& spline, const Severity& severity, int numMonths, TailContributions& tail){
+        return simulatePortfolioLossesTiled(n, portfolio, frailtyGenerator, counterLoanSimulator<Model>(spline, rng), severity, numMonths, defaultPool(), &tail);
+    }
+    /**
+    Simulates n scenarios of portfolio losses using the counter based 
+    generator, checkpointing to a file so that an interrupted run can be 
+    resumed by calling this again with the same arguments.  The next 
+    position of the generator is the first scenario not in the checkpoint.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per 
+    scenario in order; it must start from the same state when resuming
+    @param rng The counter based generator
+    @param spline The compiled spline of the model
+    @param severity Thread safe function taking the loan index, the time on 
+    books at default and the scenario index and returning the dollar loss
+    @param numMonths Number of monthly loss buckets to keep
+    @param checkpointFile The file holding the checkpoint
+    @param scenariosPerCheckpoint Number of scenarios between checkpoints
+    @param runId Identifies the inputs that are not fingerprinted, ie the 
+    severity and the frailty parameters; a checkpoint is only resumed by 
+    a run with the same runId, loans, coefficients and spline
+    @return Loss, number of defaults and optionally loss by month for each scenario
+    @throws std::runtime_error if a checkpoint cannot be written
+    */
+    template<int Model, typename F, typename S, typename Severity>
+    ScenarioLosses simulatePortfolioLosses(int n, const Portfolio& portfolio, const F& frailtyGenerator, const RCounter& rng, const S& spline, const Severity& severity, int numMonths, const std::string& checkpointFile, int scenariosPerCheckpoint, uint64_t runId=0){
+        RunMetadata metadata;
+        metadata.seed=rng.getSeed();
+        metadata.fingerprint=runFingerprint(runId, spline);
+        metadata.model=Model;
+        metadata.firstScenario=0;
+        metadata.lastScenario=n;
+        metadata.hasLoanAccumulators=0;
+        return simulatePortfolioLossesCheckpointed(n, portfolio, frailtyGenerator, counterLoanSimulator<Model>(spline, rng), severity, numMonths, metadata, checkpointFile, scenariosPerCheckpoint);
+    }
+    /**
+    Simulates one shard of an n scenario run using the counter based 
+    generator and writes its partial result file, which doubles as the 
+    shard's checkpoint.  Each shard is meant to run as a separate 
+    process; mergeLosses combines the partial files into results bit 
+    identical to a single run of every scenario.
+    @param shard The index of the shard
+    @param numShards The number of shards
+    @param n Number of scenarios in the whole run
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per 
+    scenario in order up to the last scenario of the shard; every shard 
+    must start it from the same state
+    @param rng The counter based generator
+    @param spline The compiled spline of the model
+    @param severity Thread safe function taking the loan index, the time on 
+    books at default and the scenario index and returning the dollar loss
+    @param numMonths Number of monthly loss buckets to keep
+    @param withLoanAccumulators Whether to keep each loan's loss and loss 
+    times the portfolio loss for RiskContribution::getRCCov
+    @param partialFile The partial result file of the shard
+    @param scenariosPerCheckpoint Number of scenarios between checkpoints
+    @param runId Identifies the inputs that are not fingerprinted, ie the 
+    severity and the frailty parameters; every shard must use the same one
+    @return Loss, number of defaults and optionally loss by month for each scenario in the shard
+    */
+    template<int Model, typename F, typename S, typename Severity>
+    ScenarioLosses simulatePortfolioLossesShard(int shard, int numShards, int n, const Portfolio& portfolio, const F& frailtyGenerator, const RCounter& rng, const S& spline, const Severity& severity, int numMonths, bool withLoanAccumulators, const std::string& partialFile, int scenariosPerCheckpoint, uint64_t runId=0){
+        RunMetadata metadata;
+        metadata.seed=rng.getSeed();
+        metadata.fingerprint=runFingerprint(runId, spline);
+        metadata.model=Model;
+        shardRange(shard, numShards, n, metadata.firstScenario, metadata.lastScenario);
+        metadata.hasLoanAccumulators=withLoanAccumulators;
+        return simulatePortfolioLossesCheckpointed(n, portfolio, frailtyGenerator, counterLoanSimulator<Model>(spline, rng), severity, numMonths, metadata, partialFile, scenariosPerCheckpoint);
+    }
+    /**
+    Simulates n scenarios of portfolio losses using quasi random uniforms.  
+    The uniform for a loan in a scenario is qmc.getUnif(scenario, loan+1), 
+    leaving dimension 0 for the frailty.
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario in order
+    @param qmc The scrambled Sobol sequence
+    @param spline The compiled spline of the model
+    @param severity Thread safe function taking the loan index, the time on 
+    books at default and the scenario index and returning the dollar loss
+    @param numMonths Number of monthly loss buckets to keep
+    @return Loss, number of defaults and optionally loss by month for each scenario
+    */
+    template<int Model, typename F, typename S, typename Severity>
+    ScenarioLosses simulatePortfolioLosses(int n, const Portfolio& portfolio, const F& frailtyGenerator, const RSobol& qmc, const S& spline, const Severity& severity, int numMonths=0){
+        return simulatePortfolioLossesTiled(n, portfolio, frailtyGenerator, [&](const PreparedLoan& loan, double frailty, int scenario, int loanIndex){
+            return simulatedTimeToDefaultInverse<Model>(loan, spline, frailty, qmc.getUnif(scenario, loanIndex+1));
+        }, severity, numMonths);
+    }
+    /**
+    Simulates n scenarios of default times for every loan in the portfolio 
+    using simulatedTimeToDefaultInverse and quasi random uniforms.  The 
+    uniform for a loan in a scenario is qmc.getUnif(scenario, loan+1), 
+    leaving dimension 0 for the frailty, eg through RSobol(seed).getUnif().
+    @param n Number of scenarios
+    @param portfolio The loans
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario in order
+    @param qmc The scrambled Sobol sequence
+    @param spline The compiled spline of the model
+    @return Default times for each scenario and loan
+    */
+    template<int Model, typename F, typename S>
+    auto simulatePortfolio(int n, const Portfolio& portfolio, const F& frailtyGenerator, const RSobol& qmc, const S& spline){
+        return simulatePortfolioTiled(n, portfolio, frailtyGenerator, [&](const PreparedLoan& loan, double frailty, int scenario, int loanIndex){
+            return simulatedTimeToDefaultInverse<Model>(loan, spline, frailty, qmc.getUnif(scenario, loanIndex+1));
         });
     }
+    /**
+    Simulates n scenarios of default times for every loan in the portfolio.  
+    The tuples are converted to a Portfolio, so every loan must share the 
+    coefficients and attribute means of the first loan.
+    @param n Number of scenarios
+    @param timeOnBooks The time each loan has been on the books
+    @param timeRemaining The time until each loan matures
+    @param frailtyGenerator Function returning a frailty draw, called once per scenario
+    @param unifRandGenerator Thread safe function returning a uniform draw, called once per loan and scenario
+    @param attributesAndCoefficients Tuples of attribute, attribute mean and coefficient for each loan
+    @param surv The survival function
+    @return Default times for each scenario and loan
+    */
+    template<typename C, typename F, typename Tuple, typename U, typename SurvivalFunction>
+    auto simulatePortfolio(int n, const std::vector<C>& timeOnBooks, const std::vector<C>& timeRemaining, const F& frailtyGenerator, const U& unifRandGenerator, const std::vector<std::vector<Tuple> >& attributesAndCoefficients, const SurvivalFunction& surv){
+        return simulatePortfolio(n, Portfolio::fromTuples(timeOnBooks, timeRemaining, attributesAndCoefficients), frailtyGenerator, unifRandGenerator, surv);
+    }
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,21 @@
+#include "ScenarioLosses.h"
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <cstdio>
+#endif
+namespace shazard {
+    bool replaceFile(const std::string& from, const std::string& to){
+#if defined(_WIN32)
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING)!=0;
+#else
+        return std::rename(from.c_str(), to.c_str())==0;
+#endif
+    }
+}
@@ -0,0 +1,582 @@
+#ifndef __SCENARIOLOSSES_H_INCLUDED__
+#define __SCENARIOLOSSES_H_INCLUDED__
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <utility>
+#include <stdexcept>
+namespace shazard {
+    /**
+    Renames a file over another in one atomic step: rename on POSIX and 
+    MoveFileEx on Windows.  Defined in ScenarioLosses.cpp so that the 
+    Windows headers stay out of every file that includes this one.
+    @param from The file to rename
+    @param to The file to replace
+    @return Whether the file was replaced
+    */
+    bool replaceFile(const std::string& from, const std::string& to);
+    /**
+    Losses of each scenario, reduced over the loans as they are simulated
+    */
+    struct ScenarioLosses{
+        std::vector<double> losses;//portfolio loss in each scenario
+        std::vector<int> numDefaults;//number of defaults in each scenario
+        std::vector<std::vector<double> > lossByMonth;//loss by whole month after today in each scenario; empty unless requested
+    };
+    /**
+    ExactSum adds doubles as 512 bit fixed point numbers whose least 
+    significant bit is 2^-256.  Every double between 2^-203 and 2^254 in 
+    magnitude fits with all 53 bits of its mantissa, so addition is exact 
+    whatever unit the losses are in, and a sum does not depend on the 
+    order of its terms.  This is what lets sums computed by separate 
+    shards be merged into the same bits as a single run.  Bits below 
+    2^-256 are rounded off and addends must be smaller than 2^254.
+    */
+    class ExactSum{
+    private:
+        static const int numWords=8;
+        uint64_t words[numWords];//two's complement, least significant word first
+        void add(int word, uint64_t value){
+            for(; word<numWords&&value!=0; ++word){
+                words[word]+=value;
+                value=words[word]<value;//carry
+            }
+        }
+        void subtract(int word, uint64_t value){
+            for(; word<numWords&&value!=0; ++word){
+                const uint64_t borrow=words[word]<value;
+                words[word]-=value;
+                value=borrow;
+            }
+        }
+        /**
+        @return The 64 bits of magnitude starting at bit shift
+        */
+        static uint64_t bitsAt(const uint64_t* magnitude, int shift){
+            const int word=shift/64;
+            const int bit=shift%64;
+            uint64_t bits=magnitude[word]>>bit;
+            if(bit!=0&&word+1<numWords){
+                bits|=magnitude[word+1]<<(64-bit);
+            }
+            return bits;
+        }
+        /**
+        Rounds to the nearest double, ties to even, in one step: the top 53 
+        bits are kept and the bit below them and a sticky bit for the rest 
+        decide the rounding.
+        */
+        static double magnitudeToDouble(const uint64_t* magnitude){
+            int top=numWords-1;
+            while(top>=0&&magnitude[top]==0){
+                --top;
+            }
+            if(top<0){
+                return 0;
+            }
+            int highest=64*top;//highest set bit
+            for(uint64_t bits=magnitude[top]>>1; bits!=0; bits>>=1){
+                ++highest;
+            }
+            const int lowest=highest-52;//lowest bit of the mantissa
+            if(lowest<=0){
+                return std::ldexp((double)magnitude[0], -fractionBits);//53 bits or fewer, so exact
+            }
+            uint64_t mantissa=bitsAt(magnitude, lowest)&((1ULL<<53)-1);
+            const int roundBit=lowest-1;
+            const bool isHalf=(magnitude[roundBit/64]>>(roundBit%64))&1;
+            bool isSticky=(magnitude[roundBit/64]&((1ULL<<(roundBit%64))-1))!=0;
+            for(int word=0; word<roundBit/64&&!isSticky; ++word){
+                isSticky=magnitude[word]!=0;
+            }
+            if(isHalf&&(isSticky||(mantissa&1))){
+                ++mantissa;//may carry to 2^53, which is still exact
+            }
+            return std::ldexp((double)mantissa, lowest-fractionBits);
+        }
+    public:
+        static const int fractionBits=256;
+        ExactSum(){
+            std::fill(words, words+numWords, 0);
+        }
+        void add(double x){
+            if(x==0){
+                return;
+            }
+            int exponent;
+            const double mantissa=std::frexp(std::abs(x), &exponent);//in [.5, 1)
+            uint64_t bits=(uint64_t)std::ldexp(mantissa, 53);
+            int shift=exponent-53+fractionBits;//position of the lowest mantissa bit
+            if(shift<0){
+                bits=shift<=-54?0:(uint64_t)std::llround(std::ldexp((double)bits, shift));
+                shift=0;
+            }
+            const int word=shift/64;
+            const int bit=shift%64;
+            const uint64_t low=bits<<bit;
+            const uint64_t high=bit==0?0:bits>>(64-bit);
+            if(x>0){
+                add(word, low);
+                add(word+1, high);
+            }
+            else{
+                subtract(word, low);
+                subtract(word+1, high);
+            }
+        }
+        void add(const ExactSum& other){
+            uint64_t carry=0;
+            for(int word=0; word<numWords; ++word){
+                const uint64_t sum=words[word]+other.words[word];
+                const uint64_t nextCarry=sum<words[word];
+                words[word]=sum+carry;
+                carry=nextCarry|(words[word]<sum);
+            }
+        }
+        /**
+        @return The sum correctly rounded to the nearest double, so the 
+        same bits for the same exact sum
+        */
+        double toDouble() const{
+            if((int64_t)words[numWords-1]>=0){
+                return magnitudeToDouble(words);
+            }
+            uint64_t magnitude[numWords];
+            uint64_t carry=1;
+            for(int word=0; word<numWords; ++word){
+                magnitude[word]=~words[word]+carry;
+                carry=carry&&magnitude[word]==0;
+            }
+            return -magnitudeToDouble(magnitude);
+        }
+    };
+    /**
+    Sums over scenarios of each loan's loss and of each loan's loss 
+    times the portfolio loss.  For RiskContribution::getRCCov pass 
+    getLoss() as exloss as it is, since getRCCov divides exloss by the 
+    number of scenarios itself, and getLossTimesPortfolio() divided by 
+    the number of scenarios as cov.
+    */
+    struct LoanAccumulators{
+        std::vector<ExactSum> loss;
+        std::vector<ExactSum> lossTimesPortfolio;
+        void resize(int numLoans){
+            loss.resize(numLoans);
+            lossTimesPortfolio.resize(numLoans);
+        }
+        void add(const LoanAccumulators& other){
+            resize(other.loss.size());
+            for(int i=0; i<(int)other.loss.size(); ++i){
+                loss[i].add(other.loss[i]);
+                lossTimesPortfolio[i].add(other.lossTimesPortfolio[i]);
+            }
+        }
+        std::vector<double> getLoss() const{
+            std::vector<double> result;
+            for(const auto& sum:loss){
+                result.emplace_back(sum.toDouble());
+            }
+            return result;
+        }
+        std::vector<double> getLossTimesPortfolio() const{
+            std::vector<double> result;
+            for(const auto& sum:lossTimesPortfolio){
+                result.emplace_back(sum.toDouble());
+            }
+            return result;
+        }
+    };
+    /**
+    Expected shortfall (Euler) contributions of each loan, kept while 
+    scenarios are simulated.  A bounded heap holds the tailSize worst 
+    scenarios seen so far, each with the losses of the loans that 
+    defaulted in it; a scenario that falls out of the tail is dropped 
+    with its loan losses.  Memory is O(loans*tailSize) however many 
+    scenarios are added.  Ties in portfolio loss keep the earlier 
+    scenario, so the tail, and the contributions, do not depend on the 
+    order scenarios are added or merged in.  The contributions sum to 
+    the expected shortfall.
+    */
+    class TailContributions{
+    private:
+        struct TailScenario{
+            double loss;
+            int scenario;
+            std::vector<std::pair<int, double> > loanLosses;//loan index and loss of each default
+        };
+        int numLoans;
+        int tailSize;
+        std::vector<TailScenario> heap;//least severe tail scenario on top
+        static bool isWorse(double loss, int scenario, double otherLoss, int otherScenario){
+            return loss>otherLoss||(loss==otherLoss&&scenario<otherScenario);
+        }
+        static bool isWorseScenario(const TailScenario& a, const TailScenario& b){
+            return isWorse(a.loss, a.scenario, b.loss, b.scenario);
+        }
+        /**
+        @return The tail scenarios in scenario order
+        */
+        std::vector<const TailScenario*> sortedTail() const{
+            std::vector<const TailScenario*> result;
+            for(const auto& tailScenario:heap){
+                result.emplace_back(&tailScenario);
+            }
+            std::sort(result.begin(), result.end(), [](const TailScenario* a, const TailScenario* b){return a->scenario<b->scenario;});
+            return result;
+        }
+    public:
+        /**
+        @param numLoans_ Number of loans in the portfolio
+        @param tailSize_ Number of scenarios in the tail, see tailSizeFor
+        @throws std::invalid_argument if tailSize_ is not positive
+        */
+        TailContributions(int numLoans_, int tailSize_):numLoans(numLoans_), tailSize(tailSize_){
+            if(tailSize<=0){
+                throw std::invalid_argument("tailSize must be positive");
+            }
+        }
+        /**
+        Number of tail scenarios used by RiskContribution::getEShortfall
+        @param n Number of scenarios
+        @param q The confidence level (eg, .99)
+        @return The number of scenarios in the tail
+        */
+        static int tailSizeFor(int n, double q){
+            return n-(int)(q*n);
+        }
+        int getTailSize() const{
+            return tailSize;
+        }
+        /**
+        @return Whether a scenario with this loss would enter the tail
+        */
+        bool isCandidate(double loss, int scenario) const{
+            return (int)heap.size()<tailSize||isWorse(loss, scenario, heap.front().loss, heap.front().scenario);
+        }
+        /**
+        @param loss The portfolio loss of the scenario
+        @param scenario The index of the scenario
+        @param loanLosses The loan index and loss of each default in the scenario
+        */
+        void add(double loss, int scenario, std::vector<std::pair<int, double> > loanLosses){
+            if(!isCandidate(loss, scenario)){
+                return;
+            }
+            if((int)heap.size()==tailSize){
+                std::pop_heap(heap.begin(), heap.end(), isWorseScenario);
+                heap.pop_back();
+            }
+            heap.push_back(TailScenario{loss, scenario, std::move(loanLosses)});
+            std::push_heap(heap.begin(), heap.end(), isWorseScenario);
+        }
+        /**
+        Adds the tail of another set of disjoint scenarios, eg another shard
+        @param other Contributions with the same tailSize
+        */
+        void merge(const TailContributions& other){
+            for(const auto& tailScenario:other.heap){
+                add(tailScenario.loss, tailScenario.scenario, tailScenario.loanLosses);
+            }
+        }
+        /**
+        @return The mean portfolio loss of the tail scenarios
+        */
+        double getEShortfall() const{
+            double val=0;
+            for(const TailScenario* tailScenario:sortedTail()){
+                val+=tailScenario->loss;
+            }
+            return heap.empty()?0:val/heap.size();
+        }
+        /**
+        @return The mean loss of each loan over the tail scenarios
+        */
+        std::vector<double> getContributions() const{
+            std::vector<double> contributions(numLoans, 0.0);
+            for(const TailScenario* tailScenario:sortedTail()){
+                for(const auto& loanLoss:tailScenario->loanLosses){
+                    contributions[loanLoss.first]+=loanLoss.second;
+                }
+            }
+            for(auto& contribution:contributions){
+                contribution=heap.empty()?0:contribution/heap.size();
+            }
+            return contributions;
+        }
+        /**
+        @return The tail scenarios in scenario order
+        */
+        std::vector<int> getScenarios() const{
+            std::vector<int> scenarios;
+            for(const TailScenario* tailScenario:sortedTail()){
+                scenarios.emplace_back(tailScenario->scenario);
+            }
+            return scenarios;
+        }
+    };
+    /**
+    FNV-1a hash of a range of bytes, used to fingerprint the inputs of a run
+    @param data The bytes
+    @param bytes Number of bytes
+    @param hash Hash to continue from, so that several ranges can be chained
+    @return The hash
+    */
+    inline uint64_t hashBytes(const void* data, size_t bytes, uint64_t hash=14695981039346656037ULL){
+        const unsigned char* byte=(const unsigned char*)data;
+        for(size_t i=0; i<bytes; ++i){
+            hash=(hash^byte[i])*1099511628211ULL;
+        }
+        return hash;
+    }
+    /**
+    Identifies a run so that a checkpoint is only resumed by the
+    same run.  The scenarios in [firstScenario, lastScenario) belong
+    to the run; completedScenarios of them, starting at firstScenario,
+    are stored with it.  The fingerprint is a hash of the inputs of the 
+    run that the counts do not capture, such as the loans, coefficients 
+    and spline, so that a checkpoint of a run with other inputs is not 
+    resumed.
+    */
+    struct RunMetadata{
+        uint64_t seed;//seed of the counter based generator
+        uint64_t fingerprint;//hash of the inputs of the run
+        int32_t model;
+        int32_t numScenarios;//total scenarios, which fixes how loans are blocked
+        int32_t numLoans;
+        int32_t numMonths;
+        int32_t firstScenario;
+        int32_t lastScenario;
+        int32_t completedScenarios;
+        int32_t hasLoanAccumulators;
+        /**
+        @return Whether other is a checkpoint of the same run
+        */
+        bool isSameRun(const RunMetadata& other) const{
+            return seed==other.seed&&fingerprint==other.fingerprint&&model==other.model&&numScenarios==other.numScenarios&&numLoans==other.numLoans&&numMonths==other.numMonths&&firstScenario==other.firstScenario&&lastScenario==other.lastScenario&&hasLoanAccumulators==other.hasLoanAccumulators;
+        }
+    };
+    /**
+    Appends the scenarios of next to losses
+    */
+    inline void append(ScenarioLosses& losses, const ScenarioLosses& next){
+        losses.losses.insert(losses.losses.end(), next.losses.begin(), next.losses.end());
+        losses.numDefaults.insert(losses.numDefaults.end(), next.numDefaults.begin(), next.numDefaults.end());
+        losses.lossByMonth.insert(losses.lossByMonth.end(), next.lossByMonth.begin(), next.lossByMonth.end());
+    }
+    const uint32_t lossFileMagic=0x4c5a4853;//"SHZL"
+    const uint32_t lossFileVersion=4;
+    /**
+    Writes the metadata and the completed scenarios to a binary file.
+    The file is written next to the target and renamed over it in one
+    atomic step with replaceFile, so a crash at
+    any point leaves either the previous file or the new one.  Later 
+    scenarios can be added with appendLosses.
+    @param fileName The file to write
+    @param metadata The run, with completedScenarios set
+    @param losses The completed scenarios
+    @param accumulators The loan accumulators of the completed scenarios, 
+    written when metadata.hasLoanAccumulators is set
+    @return Whether the file was written
+    */
+    inline bool writeLosses(const std::string& fileName, const RunMetadata& metadata, const ScenarioLosses& losses, const LoanAccumulators* accumulators=nullptr){
+        const std::string tempName=fileName+".tmp";
+        {
+            std::ofstream file(tempName, std::ios::binary|std::ios::trunc);
+            file.write((const char*)&lossFileMagic, sizeof(lossFileMagic));
+            file.write((const char*)&lossFileVersion, sizeof(lossFileVersion));
+            file.write((const char*)&metadata, sizeof(metadata));
+            const uint64_t headerHash=hashBytes(&metadata, sizeof(metadata));
+            file.write((const char*)&headerHash, sizeof(headerHash));
+            const int n=metadata.completedScenarios;
+            file.write((const char*)losses.losses.data(), n*sizeof(double));
+            file.write((const char*)losses.numDefaults.data(), n*sizeof(int));
+            for(int i=0; i<(int)losses.lossByMonth.size()&&i<n; ++i){
+                file.write((const char*)losses.lossByMonth[i].data(), metadata.numMonths*sizeof(double));
+            }
+            if(metadata.hasLoanAccumulators){
+                file.write((const char*)accumulators->loss.data(), metadata.numLoans*sizeof(ExactSum));
+                file.write((const char*)accumulators->lossTimesPortfolio.data(), metadata.numLoans*sizeof(ExactSum));
+            }
+            if(!file){
+                return false;
+            }
+        }
+        return replaceFile(tempName, fileName);
+    }
+    /**
+    Appends the scenarios of losses from firstScenario up to 
+    metadata.completedScenarios to a file written by writeLosses for 
+    the same run, as one block.  Only the new scenarios are written, so 
+    checkpointing n scenarios writes O(n) bytes in total rather than 
+    rewriting the file each time.  An append cut short by a crash 
+    leaves a partial block at the end, which readLosses ignores.  The 
+    loan accumulators cover every scenario so far and cannot be 
+    appended, so a run with metadata.hasLoanAccumulators set must be 
+    rewritten with writeLosses instead.
+    @param fileName The file to append to
+    @param metadata The run, with completedScenarios set
+    @param losses The completed scenarios
+    @param firstScenario The first scenario of losses not yet in the file
+    @return Whether the block was written; false if metadata.hasLoanAccumulators is set
+    */
+    inline bool appendLosses(const std::string& fileName, const RunMetadata& metadata, const ScenarioLosses& losses, int firstScenario){
+        if(metadata.hasLoanAccumulators){
+            return false;
+        }
+        std::fstream file(fileName, std::ios::binary|std::ios::in|std::ios::out|std::ios::ate);
+        if(!file){
+            return false;
+        }
+        const int32_t count=metadata.completedScenarios-firstScenario;
+        file.write((const char*)&count, sizeof(count));
+        file.write((const char*)(losses.losses.data()+firstScenario), count*sizeof(double));
+        file.write((const char*)(losses.numDefaults.data()+firstScenario), count*sizeof(int));
+        for(int i=firstScenario; i<(int)losses.lossByMonth.size()&&i<metadata.completedScenarios; ++i){
+            file.write((const char*)losses.lossByMonth[i].data(), metadata.numMonths*sizeof(double));
+        }
+        file.flush();
+        return (bool)file;
+    }
+    /**
+    Reads a file written by writeLosses and any blocks added by 
+    appendLosses.  The header is checked, and the sizes it implies are 
+    checked against the size of the file before anything is allocated, 
+    so a file with a corrupt header or a truncated first block and loan 
+    accumulators gives false.  A partial block at the end, left by an 
+    interrupted append, is ignored along with anything after it.  The outputs are only set when the file is valid.
+    @param fileName The file to read
+    @param metadata Set to the stored run
+    @param losses Set to the stored scenarios
+    @param accumulators Set to the stored loan accumulators, if any
+    @return Whether a complete file was read
+    */
+    inline bool readLosses(const std::string& fileName, RunMetadata& metadata, ScenarioLosses& losses, LoanAccumulators* accumulators=nullptr){
+        std::ifstream file(fileName, std::ios::binary|std::ios::ate);
+        if(!file){
+            return false;
+        }
+        long long remaining=file.tellg();
+        file.seekg(0);
+        uint32_t magic=0, version=0;
+        RunMetadata stored;
+        file.read((char*)&magic, sizeof(magic));
+        file.read((char*)&version, sizeof(version));
+        uint64_t headerHash=0;
+        file.read((char*)&stored, sizeof(stored));
+        file.read((char*)&headerHash, sizeof(headerHash));
+        remaining-=sizeof(magic)+sizeof(version)+sizeof(stored)+sizeof(headerHash);
+        if(!file||magic!=lossFileMagic||version!=lossFileVersion||headerHash!=hashBytes(&stored, sizeof(stored))){
+            return false;
+        }
+        if(stored.firstScenario<0||stored.lastScenario<stored.firstScenario||stored.completedScenarios<0||stored.completedScenarios>stored.lastScenario-stored.firstScenario||stored.numMonths<0||stored.numLoans<0||(stored.hasLoanAccumulators!=0&&stored.hasLoanAccumulators!=1)){
+            return false;
+        }
+        const long long bytesPerScenario=sizeof(double)+sizeof(int)+(long long)stored.numMonths*sizeof(double);
+        const long long accumulatorBytes=stored.hasLoanAccumulators?2LL*stored.numLoans*sizeof(ExactSum):0;
+        ScenarioLosses storedLosses;
+        LoanAccumulators storedAccumulators;
+        auto readBlock=[&](int count){
+            const int begin=storedLosses.losses.size();
+            storedLosses.losses.resize(begin+count);
+            storedLosses.numDefaults.resize(begin+count);
+            file.read((char*)(storedLosses.losses.data()+begin), count*sizeof(double));
+            file.read((char*)(storedLosses.numDefaults.data()+begin), count*sizeof(int));
+            if(stored.numMonths>0){
+                storedLosses.lossByMonth.resize(begin+count);
+                for(int i=begin; i<begin+count; ++i){
+                    storedLosses.lossByMonth[i].resize(stored.numMonths);
+                    file.read((char*)storedLosses.lossByMonth[i].data(), stored.numMonths*sizeof(double));
+                }
+            }
+            remaining-=count*bytesPerScenario;
+        };
+        const int n=stored.completedScenarios;
+        if(accumulatorBytes>remaining||n>(remaining-accumulatorBytes)/bytesPerScenario){
+            return false;
+        }
+        storedAccumulators.resize(stored.hasLoanAccumulators?stored.numLoans:0);
+        readBlock(n);
+        file.read((char*)storedAccumulators.loss.data(), storedAccumulators.loss.size()*sizeof(ExactSum));
+        file.read((char*)storedAccumulators.lossTimesPortfolio.data(), storedAccumulators.lossTimesPortfolio.size()*sizeof(ExactSum));
+        remaining-=accumulatorBytes;
+        int32_t count=0;
+        while(file&&!stored.hasLoanAccumulators&&remaining>=(long long)sizeof(count)){
+            file.read((char*)&count, sizeof(count));
+            remaining-=sizeof(count);
+            if(!file||count<=0||count>stored.lastScenario-stored.firstScenario-stored.completedScenarios||count>remaining/bytesPerScenario){
+                break;//partial block
+            }
+            readBlock(count);
+            stored.completedScenarios+=count;
+        }
+        if(!file){
+            return false;
+        }
+        metadata=stored;
+        losses=std::move(storedLosses);
+        if(stored.hasLoanAccumulators&&accumulators){
+            *accumulators=std::move(storedAccumulators);
+        }
+        return true;
+    }
+    /**
+    Merges the partial result files of the shards of a run.  The shards 
+    must be of the same run, complete, and together cover every scenario 
+    exactly once; they may be given in any order.  The scenario losses 
+    are concatenated in scenario order and the loan accumulators added 
+    exactly, so the result is bit identical to a single run.
+    @param fileNames The partial result files
+    @param metadata Set to the metadata of the merged run
+    @param losses Set to the losses of every scenario
+    @param accumulators Set to the merged loan accumulators, if the shards have them
+    @return Whether the shards were read and cover the run
+    */
+    inline bool mergeLosses(const std::vector<std::string>& fileNames, RunMetadata& metadata, ScenarioLosses& losses, LoanAccumulators* accumulators=nullptr){
+        std::vector<RunMetadata> shards(fileNames.size());
+        std::vector<ScenarioLosses> shardLosses(fileNames.size());
+        std::vector<LoanAccumulators> shardAccumulators(fileNames.size());
+        for(int i=0; i<(int)fileNames.size(); ++i){
+            if(!readLosses(fileNames[i], shards[i], shardLosses[i], &shardAccumulators[i])||shards[i].completedScenarios!=shards[i].lastScenario-shards[i].firstScenario){
+                return false;
+            }
+        }
+        if(shards.empty()){
+            return false;
+        }
+        std::vector<int> order(shards.size());
+        for(int i=0; i<(int)order.size(); ++i){
+            order[i]=i;
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b){return shards[a].firstScenario<shards[b].firstScenario;});
+        metadata=shards[order.front()];
+        metadata.firstScenario=0;
+        metadata.lastScenario=0;
+        losses=ScenarioLosses();
+        if(accumulators){
+            *accumulators=LoanAccumulators();
+            accumulators->resize(metadata.numLoans);
+        }
+        for(int i:order){
+            RunMetadata shard=shards[i];
+            if(shard.firstScenario!=metadata.lastScenario){
+                return false;
+            }
+            shard.firstScenario=0;
+            shard.lastScenario=metadata.lastScenario;
+            if(!metadata.isSameRun(shard)){
+                return false;
+            }
+            append(losses, shardLosses[i]);
+            if(accumulators&&metadata.hasLoanAccumulators){
+                accumulators->add(shardAccumulators[i]);
+            }
+            metadata.lastScenario=shards[i].lastScenario;
+        }
+        metadata.completedScenarios=metadata.lastScenario;
+        return metadata.lastScenario==metadata.numScenarios;
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,203 @@
+#ifndef __THREADPOOL_H_INCLUDED__
+#define __THREADPOOL_H_INCLUDED__
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+/**
+WorkStealingPool runs a flat range of independent tasks on a fixed
+set of threads, one per core.  Each thread starts with a contiguous
+slice of the tasks in its own queue and, once that is empty, steals
+from the front of the other queues.  This balances work when tasks
+take very different amounts of time without creating more threads
+than cores.  The calling thread takes part as worker 0.  If a task
+throws, the tasks not yet started are dropped and the first exception
+is rethrown by parallelFor once every worker is idle.  A parallelFor 
+called from a task of the same pool runs inline on the calling 
+worker, since every other worker may be busy with the outer job.
+*/
+class WorkStealingPool{
+private:
+    struct Queue{
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+    int numWorkers;
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> threads;
+    std::mutex runMutex;//one parallelFor at a time
+    std::mutex jobMutex;
+    std::condition_variable jobCondition;
+    std::condition_variable doneCondition;
+    std::function<void(int)> job;
+    std::exception_ptr error;//first exception thrown by a task of the current job
+    int jobId;
+    int busyWorkers;
+    bool isStopping;
+    /**
+    @return The pools whose tasks the calling thread is running, innermost last
+    */
+    static std::vector<const WorkStealingPool*>& activePools(){
+        static thread_local std::vector<const WorkStealingPool*> pools;
+        return pools;
+    }
+    bool popOwn(int worker, int& task){
+        Queue& queue=*queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.tasks.empty()){
+            return false;
+        }
+        task=queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+    bool steal(int worker, int& task){
+        for(int k=1; k<numWorkers; ++k){
+            Queue& queue=*queues[(worker+k)%numWorkers];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(!queue.tasks.empty()){
+                task=queue.tasks.front();
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    void clearQueues(){
+        for(auto& queue:queues){
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->tasks.clear();
+        }
+    }
+    void runTasks(int worker){
+        activePools().push_back(this);
+        int task;
+        while(popOwn(worker, task)||steal(worker, task)){
+            try{
+                job(task);
+            }
+            catch(...){
+                {
+                    std::lock_guard<std::mutex> lock(jobMutex);
+                    if(!error){
+                        error=std::current_exception();
+                    }
+                }
+                clearQueues();
+            }
+        }
+        activePools().pop_back();
+    }
+    void workerLoop(int worker){
+        int seenJob=0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobCondition.wait(lock, [&](){return isStopping||jobId!=seenJob;});
+                if(isStopping){
+                    return;
+                }
+                seenJob=jobId;
+            }
+            runTasks(worker);
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                if(--busyWorkers==0){
+                    doneCondition.notify_all();
+                }
+            }
+        }
+    }
+public:
+    /**
+    @param numThreads Number of workers including the calling thread;
+    defaults to the number of cores
+    */
+    WorkStealingPool(int numThreads=0):jobId(0), busyWorkers(0), isStopping(false){
+        numWorkers=numThreads>0?numThreads:std::max(1, (int)std::thread::hardware_concurrency());
+        for(int i=0; i<numWorkers; ++i){
+            queues.emplace_back(new Queue());
+        }
+        for(int i=1; i<numWorkers; ++i){
+            threads.emplace_back([this, i](){
+                workerLoop(i);
+            });
+        }
+    }
+    ~WorkStealingPool(){
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            isStopping=true;
+        }
+        jobCondition.notify_all();
+        for(auto& thread:threads){
+            thread.join();
+        }
+    }
+    /**
+    Runs fn(task) for every task in [0, numTasks) and returns when all
+    have finished.  Tasks must be independent of each other.  If any
+    task throws, the remaining tasks may be skipped and the first
+    exception is rethrown here after all workers have stopped.  Only 
+    one job runs at a time: a call from another thread waits for the 
+    current job, and a call from inside a task of this pool runs every 
+    task inline, in order, on the calling worker.
+    @param numTasks Number of tasks
+    @param fn Function taking the index of the task
+    */
+    template<typename F>
+    void parallelFor(int numTasks, const F& fn){
+        const auto& active=activePools();
+        if(std::find(active.begin(), active.end(), this)!=active.end()){
+            for(int task=0; task<numTasks; ++task){
+                fn(task);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> run(runMutex);
+        for(int w=0; w<numWorkers; ++w){
+            const int begin=(int)((long long)numTasks*w/numWorkers);
+            const int end=(int)((long long)numTasks*(w+1)/numWorkers);
+            Queue& queue=*queues[w];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            for(int task=end-1; task>=begin; --task){//popped from the back, so the slice runs in order
+                queue.tasks.push_back(task);
+            }
+        }
+        job=fn;
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            busyWorkers=numWorkers-1;
+            ++jobId;
+        }
+        jobCondition.notify_all();
+        runTasks(0);
+        std::exception_ptr jobError;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            doneCondition.wait(lock, [&](){return busyWorkers==0;});
+            std::swap(jobError, error);
+        }
+        if(jobError){
+            std::rethrow_exception(jobError);
+        }
+    }
+    int size() const{
+        return numWorkers;
+    }
+};
+/**
+@return A pool shared by the whole program with one worker per core.  
+Code running in one of its tasks may call its parallelFor again, which 
+then runs inline.
+*/
+inline WorkStealingPool& defaultPool(){
+    static WorkStealingPool pool;
+    return pool;
+}
+#endif
\ No newline at end of file
@@ -1,3 +1,3 @@
 set mypath=%cd%
 rem cd /d "\Program Files (x86)\Microsoft Visual Studio 14.0\VC"
-cmd /k "cd \Program Files (x86)\Microsoft Visual Studio 14.0\VC & vcvarsall amd64 & cd /d %mypath% & cl /EHsc /openmp /O2 /I rapidjson/include/rapidjson user32.lib  odbc32.lib Main.cpp AutoDiff.cpp & exit 0"
+cmd /k "cd \Program Files (x86)\Microsoft Visual Studio 14.0\VC & vcvarsall amd64 & cd /d %mypath% & cl /EHsc /openmp /O2 /I rapidjson/include/rapidjson user32.lib  odbc32.lib Main.cpp AutoDiff.cpp ScenarioLosses.cpp & exit 0"
@@ -5,11 +5,62 @@
 #include "EGD.h"
 #include "Matrix.h"
 #include "MC.h"
+#include "VMath.h"
+#include "DefaultTimeTable.h"
+#include "Portfolio.h"
+#include "ThreadPool.h"
+#include "RCounter.h"
+#include "RSobol.h"
+#include "GammaFrailty.h"
+#include "LossDistribution.h"
+#include "RNorm.h"
+#include "RUnif.h"
+#include "AdaptiveMC.h"
+#include "QuantileSketch.h"
+#include "SHazard.h"
 #include <sstream>
 #include <thread>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <cstddef>
+#include <iterator>
+#include <random>
+#include <cstdlib>
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
+/**
+Knots of the gamma spline shared by the spline and survival tests
+*/
+static std::vector<std::tuple<double, double> > testKnots(){
+    return {
+        std::make_tuple(-1.0, -4.0), std::make_tuple(0.5, 1.2), std::make_tuple(1.5, 0.03), std::make_tuple(2.5, -0.01), std::make_tuple(4.0, 0.005)
+    };
+}
+/**
+Portfolio of one attribute loans shared by the simulation tests
+*/
+static Portfolio testPortfolio(int numLoans){
+    Portfolio portfolio(1);
+    for(int i=0; i<numLoans; ++i){
+        portfolio.addLoan(i%24, 36, {(i%7)*.5});
+    }
+    portfolio.setCoefficients({.8});
+    return portfolio;
+}
+/**
+@return A path in the temporary directory, unique to this run of the tests
+*/
+static std::string tempPath(const std::string& name){
+    static const std::string prefix=[](){
+        const char* dir=std::getenv("TMPDIR");
+        dir=dir?dir:std::getenv("TEMP");
+        std::ostringstream path;
+        path<<(dir?dir:"/tmp")<<"/shazard-"<<std::random_device()()<<"-"<<std::chrono::steady_clock::now().time_since_epoch().count()<<"-";
+        return path.str();
+    }();
+    return prefix+name;
+}
 TEST_CASE("Test convertMapAndVectorToJson", "[NodeCommunicate]"){
     std::vector<double> testV={.5, .6, .7};
     std::unordered_map<std::string, std::vector<double>*> tt;
@@ -84,6 +135,870 @@ TEST_CASE("Test simulateDistribution", "[MC]"){
     REQUIRE(mc.getEstimate()==3.0);
     
     
+}
+TEST_CASE("Test precision based stopping", "[AdaptiveMC]"){
+    RUnif runif(3);
+    AdaptiveMC<double> mc(100, 1000000, 60);
+    mc.simulateMean([&](){
+        return runif.getUnif();
+    }, .01);
+    REQUIRE(mc.getIsConverged());
+    REQUIRE(mc.getStandardError()<=.01);
+    REQUIRE(mc.getNumSimulations()<1000);
+    REQUIRE(std::abs(mc.getEstimate()-.5)<.04);
+    RNorm rnorm(3);
+    mc.simulateVaR([&](){
+        return rnorm.getNorm();
+    }, .99, .05);
+    REQUIRE(mc.getIsConverged());
+    REQUIRE(mc.getHalfWidth()<=.05);
+    REQUIRE(std::abs(mc.getEstimate()-2.326)<.1);
+    mc.simulateEShortfall([&](){
+        return rnorm.getNorm();
+    }, .99, .05);
+    REQUIRE(mc.getIsConverged());
+    REQUIRE(std::abs(mc.getEstimate()-2.665)<.1);
+    AdaptiveMC<double> budgeted(100, 100000000, .05);
+    budgeted.simulateVaR([&](){
+        return rnorm.getNorm();
+    }, .99, 1e-6);
+    REQUIRE(!budgeted.getIsConverged());
+    REQUIRE(budgeted.getNumSimulations()<100000000);
+}
+TEST_CASE("Test invalid arguments", "[AdaptiveMC]"){
+    REQUIRE_THROWS_AS(AdaptiveMC<double>(0, 1000, 60), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(AdaptiveMC<double>(100, 0, 60), const std::invalid_argument&);
+    RNorm rnorm(3);
+    auto draw=[&](){
+        return rnorm.getNorm();
+    };
+    AdaptiveMC<double> mc(100, 100000, 60);
+    REQUIRE_THROWS_AS(mc.simulateVaR(draw, .99, .05, 1), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(mc.simulateEShortfall(draw, .99, .05, 0), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(mc.simulateVaR(draw, 1.0, .05), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(mc.simulateEShortfall(draw, 0.0, .05), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(AdaptiveMC<double>(1, 5, 60).simulateVaR(draw, .9, .05), const std::invalid_argument&);
+    AdaptiveMC<double> small(1, 1000, 60);
+    small.simulateVaR(draw, .9, 1e-6, 10);
+    REQUIRE(!small.getIsConverged());
+    REQUIRE(small.getNumSimulations()==1000);
+}
+TEST_CASE("Test exp, log and erfc", "[VMath]"){
+    for(double x=-700; x<700; x+=.37){
+        REQUIRE(std::abs(vmath::exp(x)/exp(x)-1)<1e-15);
+    }
+    for(double x=.001; x<1000; x*=1.01){
+        REQUIRE(std::abs(vmath::log(x)-log(x))<1e-15*std::max(1.0, std::abs(log(x))));
+    }
+    for(double x=-6; x<6; x+=.01){
+        REQUIRE(std::abs(vmath::erfc(x)/erfc(x)-1)<1.2e-7);
+    }
+}
+TEST_CASE("Test simulate", "[DefaultTimeTable]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    double tolerance=.01;
+    DefaultTimeTable<Odds, shazard::Spline> table(spline, -2, 2, 48, .000001, .5, tolerance);
+    REQUIRE(table.getMaxError()<tolerance);
+    for(double offset=-1.9; offset<2; offset+=.3){
+        for(double timeOnBooks=0; timeOnBooks<48; timeOnBooks+=7){
+            for(double unif=.00001; unif<.5; unif*=3){
+                double exact=shazard::simulatedTimeToDefaultInverse<Odds>(timeOnBooks, 100, offset, spline, 1.0, unif);
+                double approx=table.simulate(timeOnBooks, 100, offset, 1.0, unif);
+                if(exact<100&&approx<100){
+                    REQUIRE(std::abs(log1p(approx)-log1p(exact))<2*tolerance);
+                }
+            }
+        }
+    }
+    REQUIRE(table.simulate(60, 10, .5, 1.0, .1)==shazard::simulatedTimeToDefaultInverse<Odds>(60, 10, .5, spline, 1.0, .1));
+    REQUIRE_THROWS_AS((DefaultTimeTable<Odds, shazard::Spline>(spline, -2, 2, 48, .000001, .5, .001, 17)), const std::runtime_error&);
+    DefaultTimeTable<Odds, shazard::Spline> neverDefaults(spline, -2, 2, 48, .000001, .99, tolerance);//some nodes near .99 never default
+    for(double offset=-1.9; offset<2; offset+=.3){
+        for(double unif=.9; unif<.99; unif+=.01){
+            double exact=shazard::simulatedTimeToDefaultInverse<Odds>(40, 50000, offset, spline, 1.0, unif);
+            double approx=neverDefaults.simulate(40, 50000, offset, 1.0, unif);
+            REQUIRE(std::abs(log1p(approx)-log1p(exact))<2*tolerance);
+        }
+    }
+}
+TEST_CASE("Test linearPredictors", "[Portfolio]"){
+    Portfolio portfolio(2);
+    portfolio.addLoan(5, 30, {1.0, 2.0});
+    portfolio.addLoan(0, 60, {3.0, 4.0});
+    portfolio.addLoan(12, 24, {2.0, 6.0});
+    portfolio.computeAttributeMeans();
+    REQUIRE(portfolio.getAttributeMeans()[0]==2.0);
+    REQUIRE(portfolio.getAttributeMeans()[1]==4.0);
+    portfolio.setCoefficients({.5, -.25});
+    std::vector<double> expected={0.0, .5, -.5};
+    REQUIRE(portfolio.linearPredictors()==expected);
+    std::vector<double> expectedSwapped={-1.0, 1.0, 0.0};
+    REQUIRE(portfolio.linearPredictors({1.0, 0.0})==expectedSwapped);
+    WorkStealingPool pool(2);
+    auto multiple=portfolio.linearPredictors({{.5, -.25}, {1.0, 0.0}}, pool);
+    REQUIRE(multiple[0]==expected);
+    REQUIRE(multiple[1]==expectedSwapped);
+    REQUIRE(portfolio.getTimeRemaining(2)==24);
+    REQUIRE((size_t)portfolio.getAttributeColumn(1)%64==0);
+    std::vector<double> timeOnBooks={5, 0};
+    std::vector<double> timeRemaining={30, 60};
+    std::vector<std::vector<std::tuple<double, double, double> > > tuples={
+        {std::make_tuple(1.0, 2.0, .5)}, {std::make_tuple(3.0, 2.0, .5)}
+    };
+    Portfolio fromTuples=Portfolio::fromTuples(timeOnBooks, timeRemaining, tuples);
+    REQUIRE(fromTuples.linearPredictors()==std::vector<double>({-.5, .5}));
+    tuples[1]={std::make_tuple(3.0, 2.0, .7)};
+    REQUIRE_THROWS_AS(Portfolio::fromTuples(timeOnBooks, timeRemaining, tuples), const std::invalid_argument&);
+    tuples[1]={std::make_tuple(3.0, 2.0, .5), std::make_tuple(1.0, 0.0, .1)};
+    REQUIRE_THROWS_AS(Portfolio::fromTuples(timeOnBooks, timeRemaining, tuples), const std::invalid_argument&);
+}
+TEST_CASE("Test blocked linearPredictors", "[Portfolio]"){
+    Portfolio portfolio(3);
+    int numLoans=2048*5+17;//several blocks and a partial one
+    for(int i=0; i<numLoans; ++i){
+        portfolio.addLoan(i%24, 36, {(i%7)*.5, (i%11)*.1, (double)(i%3)});
+    }
+    portfolio.computeAttributeMeans();
+    std::vector<std::vector<double> > coefficientSets={{.8, -.3, .1}, {.2, .5, -1.0}};
+    WorkStealingPool singleThread(1), fourThreads(4), manyThreadPool(64);
+    auto serial=portfolio.linearPredictors(coefficientSets, singleThread);
+    auto parallel=portfolio.linearPredictors(coefficientSets, fourThreads);
+    REQUIRE(parallel==serial);
+    auto manyThreads=portfolio.linearPredictors(coefficientSets, manyThreadPool);
+    REQUIRE(manyThreads==serial);
+    auto means=portfolio.getAttributeMeans();
+    for(int k=0; k<2; ++k){
+        for(int i=0; i<numLoans; ++i){
+            double expected=0;
+            for(int j=0; j<3; ++j){
+                expected+=(portfolio.getAttribute(i, j)-means[j])*coefficientSets[k][j];
+            }
+            REQUIRE(std::abs(serial[k][i]-expected)<1e-12);
+        }
+    }
+    Portfolio balances(2);
+    for(int i=0; i<numLoans; ++i){
+        balances.addLoan(i%24, 36, {1e9+(i%5)*.01, 700.0+i%3});
+    }
+    balances.computeAttributeMeans();
+    balances.setCoefficients({1.0, .01});
+    auto largePredictors=balances.linearPredictors();
+    for(int i=0; i<numLoans; ++i){
+        std::vector<std::tuple<double, double, double> > attributesAndCoefficients;
+        for(int j=0; j<2; ++j){
+            attributesAndCoefficients.emplace_back(balances.getAttribute(i, j), balances.getAttributeMeans()[j], balances.getCoefficients()[j]);
+        }
+        REQUIRE(std::abs(largePredictors[i]-shazard::linearPredictor(attributesAndCoefficients))<1e-14);
+    }
+}
+TEST_CASE("Test parallelFor", "[ThreadPool]"){
+    WorkStealingPool pool(4);
+    std::vector<int> visited(1000, 0);
+    pool.parallelFor(1000, [&](int task){
+        visited[task]++;
+    });
+    REQUIRE(std::count(visited.begin(), visited.end(), 1)==1000);
+    pool.parallelFor(10, [&](int task){
+        visited[task]++;
+    });
+    REQUIRE(visited[9]==2);
+    REQUIRE(visited[10]==1);
+    for(int failedTask:{0, 999}){//the caller's slice and a worker's slice
+        std::atomic<int> numRun(0);
+        REQUIRE_THROWS_AS(pool.parallelFor(1000, [&](int task){
+            ++numRun;
+            std::this_thread::sleep_for(std::chrono::microseconds(10));
+            if(task==failedTask){
+                throw std::runtime_error("task failed");
+            }
+        }), const std::runtime_error&);
+        REQUIRE(numRun<=1000);
+        std::atomic<int> numAfter(0);
+        pool.parallelFor(1000, [&](int task){
+            ++numAfter;
+        });
+        REQUIRE(numAfter==1000);
+    }
+    std::vector<std::vector<int> > nested(8, std::vector<int>(100, 0));
+    pool.parallelFor(8, [&](int outer){
+        pool.parallelFor(100, [&](int inner){//would deadlock if it waited for the outer job
+            nested[outer][inner]++;
+        });
+    });
+    for(const auto& row:nested){
+        REQUIRE(std::count(row.begin(), row.end(), 1)==100);
+    }
+}
+TEST_CASE("Test philox", "[RCounter]"){
+    std::array<uint32_t, 4> expected={0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8};
+    REQUIRE(RCounter::philox({0, 0, 0, 0}, {0, 0})==expected);
+    expected={0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd};
+    REQUIRE(RCounter::philox({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff})==expected);
+    RCounter rng(42);
+    REQUIRE(rng.getUnif(10, 3)==RCounter(42).getUnif(10, 3));
+    REQUIRE(rng.getUnif(10, 3)!=rng.getUnif(10, 3, 1));
+    REQUIRE(rng.getUnif(10, 3)!=rng.getUnif(11, 3));
+    double sum=0;
+    int n=100000;
+    for(int i=0; i<n; ++i){
+        sum+=rng.getUnif(i, 0);
+    }
+    REQUIRE(std::abs(sum/n-.5)<.005);
+}
+TEST_CASE("Test sobol", "[RSobol]"){
+    std::vector<double> expected={0, .5, .75, .25, .625, .125, .375, .875};
+    for(int i=0; i<8; ++i){
+        REQUIRE(RSobol::sobol(i, 1)/4294967296.0==expected[i]);
+    }
+    RSobol qmc(3);
+    int m=4;
+    int numPoints=1<<(2*m);
+    for(int dimension=0; dimension<20; ++dimension){
+        std::vector<int> strata(numPoints, 0);
+        for(int i=0; i<numPoints; ++i){
+            strata[(int)(qmc.getUnif(i, dimension)*numPoints)]++;
+        }
+        REQUIRE(std::count(strata.begin(), strata.end(), 1)==numPoints);
+    }
+    std::vector<int> cells(numPoints, 0);
+    for(int i=0; i<numPoints; ++i){
+        cells[(int)(qmc.getUnif(i, 0)*(1<<m))*(1<<m)+(int)(qmc.getUnif(i, 1)*(1<<m))]++;
+    }
+    REQUIRE(std::count(cells.begin(), cells.end(), 1)==numPoints);
+    REQUIRE(qmc.getUnif(5, 2)!=RSobol(4).getUnif(5, 2));
+    RSobol stream(3, 2);
+    REQUIRE(stream.getUnif()==qmc.getUnif(0, 2));
+    REQUIRE(stream.getUnif()==qmc.getUnif(1, 2));
+}
+TEST_CASE("Test fill", "[RNorm]"){
+    int n=200001;
+    std::vector<double> norms(n);
+    RNorm rnorm(5);
+    rnorm.fill(norms.data(), n);
+    double mean=0, variance=0;
+    for(double norm:norms){
+        mean+=norm;
+        variance+=norm*norm;
+    }
+    mean/=n;
+    variance=variance/n-mean*mean;
+    REQUIRE(std::abs(mean)<.01);
+    REQUIRE(std::abs(variance-1)<.01);
+    std::vector<double> again(n);
+    RNorm(5).fill(again.data(), n);
+    REQUIRE(again==norms);
+    //the same bits under any contractions; 105, 106 and 141 differ between fused and unfused multiply-adds
+    REQUIRE(norms[0]==0.86394503559301283);
+    REQUIRE(norms[1]==0.21313376994404459);
+    REQUIRE(norms[2]==-0.77478385152740392);
+    REQUIRE(norms[3]==-1.5428727846644481);
+    REQUIRE(norms[105]==0.96332102936419428);
+    REQUIRE(norms[106]==0.71631679312879115);
+    REQUIRE(norms[141]==1.6173733742736549);
+    std::vector<double> unifs(n);
+    RUnif(5).fill(unifs.data(), n);
+    REQUIRE(*std::min_element(unifs.begin(), unifs.end())>0);
+    REQUIRE(*std::max_element(unifs.begin(), unifs.end())<1);
+    REQUIRE(std::abs(std::accumulate(unifs.begin(), unifs.end(), 0.0)/n-.5)<.005);
+}
+TEST_CASE("Test Spline", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    REQUIRE(spline.numberOfKnots()==5);
+    for(double x=-3; x<6; x+=.01){
+        double expected=shazard::cspline(x, knots_gamma);
+        REQUIRE(std::abs(spline(x)-expected)<1e-13*std::max(1.0, std::abs(expected)));
+        double h=1e-5;
+        double difference=(shazard::cspline(x+h, knots_gamma)-shazard::cspline(x-h, knots_gamma))/(2*h);
+        REQUIRE(std::abs(spline.derivative(x)-difference)<1e-6);
+    }
+}
+TEST_CASE("Test FixedSpline", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    shazard::FixedSpline<5> fixed(knots_gamma);
+    REQUIRE(fixed.numberOfKnots()==5);
+    for(double x=-3; x<6; x+=.01){
+        REQUIRE(std::abs(fixed(x)-spline(x))<1e-13*std::max(1.0, std::abs(spline(x))));//may differ in the last bits when contracted into fma
+        REQUIRE(std::abs(fixed.derivative(x)-spline.derivative(x))<1e-13*std::max(1.0, std::abs(spline.derivative(x))));
+    }
+    int numKnots=shazard::withSpline(knots_gamma, [](const auto& compiled){
+        return compiled.numberOfKnots();
+    });
+    REQUIRE(numKnots==5);
+    REQUIRE_THROWS_AS((void)shazard::FixedSpline<6>(knots_gamma), const std::invalid_argument&);
+    REQUIRE_THROWS_AS((void)shazard::FixedSpline<4>(knots_gamma), const std::invalid_argument&);
+}
+TEST_CASE("Test survival conventions", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    const double frailty=1.7, offset=.3;
+    for(double timeHorizon:{2.0, 12.0, 40.0}){
+        const double g=spline(log(timeHorizon))+offset+log(frailty);
+        REQUIRE(std::abs(shazard::SurvivalProbabilityOdds(timeHorizon, 0.0, offset, frailty, spline)-1.0/(1.0+exp(g)))<1e-15);
+        REQUIRE(std::abs(shazard::SurvivalProbabilityHazard(timeHorizon, 0.0, offset, frailty, spline)-exp(-exp(g)))<1e-15);
+        REQUIRE(std::abs(shazard::SurvivalProbabilityProbit(timeHorizon, 0.0, offset, frailty, spline)-.5*erfc(g/sqrt(2.0)))<1e-15);//Phi(-g)
+        REQUIRE(shazard::SurvivalProbabilityOdds(timeHorizon, 1.0, offset, frailty, spline)==shazard::SurvivalProbabilityOdds(timeHorizon, 1.0, offset+log(frailty), 1.0, spline));
+        REQUIRE(shazard::SurvivalProbabilityProbit(timeHorizon, 1.0, offset+1, frailty, spline)<shazard::SurvivalProbabilityProbit(timeHorizon, 1.0, offset, frailty, spline));
+    }
+}
+TEST_CASE("Test cspline_batch", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    std::vector<double> x;
+    for(int i=0; i<1003; ++i){//not a multiple of the vector width, so the scalar remainder runs too
+        x.emplace_back(-3+i*.009);
+    }
+    auto batch=shazard::cspline_batch(spline, x);
+    for(int i=0; i<(int)x.size(); ++i){
+        double expected=shazard::cspline(x[i], knots_gamma);
+        REQUIRE(std::abs(batch[i]-expected)<1e-13*std::max(1.0, std::abs(expected)));
+        REQUIRE(std::abs(batch[i]-spline(x[i]))<1e-14*std::max(1.0, std::abs(expected)));
+    }
+    std::vector<double> offsets={-1.0, 0.0, .25, 3.0};
+    auto offsetBatch=shazard::cspline_batch(spline, 2.0, offsets);
+    for(int i=0; i<(int)offsets.size(); ++i){
+        REQUIRE(offsetBatch[i]==spline(2.0)+offsets[i]);
+    }
+    int width=shazard::simdWidth();
+    REQUIRE((width==1||width==4||width==8));
+}
+TEST_CASE("Test SurvivalProbabilityBatch", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    std::vector<double> timeHorizon, currentTime, offset;
+    for(int i=0; i<203; ++i){
+        currentTime.emplace_back(i%5==0?0.0:(i%37)*1.5);
+        timeHorizon.emplace_back(currentTime.back()+1+i%60);
+        offset.emplace_back(-2+(i%9)*.5);
+    }
+    double frailty=1.3;
+    auto odds=shazard::SurvivalProbabilityOddsBatch(timeHorizon, currentTime, offset, frailty, spline);
+    auto hazard=shazard::SurvivalProbabilityHazardBatch(timeHorizon, currentTime, offset, frailty, spline);
+    auto probit=shazard::SurvivalProbabilityProbitBatch(timeHorizon, currentTime, offset, frailty, spline);
+    for(int i=0; i<(int)timeHorizon.size(); ++i){
+        double expectedOdds=shazard::SurvivalProbabilityOdds(timeHorizon[i], currentTime[i], offset[i], frailty, spline);
+        double expectedHazard=shazard::SurvivalProbabilityHazard(timeHorizon[i], currentTime[i], offset[i], frailty, spline);
+        double expectedProbit=shazard::SurvivalProbabilityProbit(timeHorizon[i], currentTime[i], offset[i], frailty, spline);
+        REQUIRE(std::abs(odds[i]/expectedOdds-1)<1e-13);
+        REQUIRE(std::abs(hazard[i]/expectedHazard-1)<1e-13);
+        REQUIRE(std::abs(probit[i]/expectedProbit-1)<5e-7);
+    }
+    std::vector<double> zeroHorizon={0.0, 0.0, 5.0}, zeroCurrent={0.0, 0.0, 0.0}, zeroOffset={0.0, 2.0, 0.0};
+    for(auto survival:{shazard::SurvivalProbabilityOddsBatch(zeroHorizon, zeroCurrent, zeroOffset, frailty, spline), shazard::SurvivalProbabilityHazardBatch(zeroHorizon, zeroCurrent, zeroOffset, frailty, spline), shazard::SurvivalProbabilityProbitBatch(zeroHorizon, zeroCurrent, zeroOffset, frailty, spline)}){
+        REQUIRE(survival[0]==1.0);
+        REQUIRE(survival[1]==1.0);
+        REQUIRE(survival[2]<1.0);
+    }
+}
+TEST_CASE("Test PreparedLoan", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    auto surv=[&](double timeHorizon, double currentTime, double offset, double frailty){
+        return shazard::SurvivalProbabilityOdds(timeHorizon, currentTime, offset, frailty, spline);
+    };
+    std::vector<double> timeOnBooks, timeRemaining;
+    std::vector<std::vector<std::tuple<double, double, double> > > attributesAndCoefficients;
+    for(int i=0; i<20; ++i){
+        timeOnBooks.emplace_back(i*2.0);
+        timeRemaining.emplace_back(36.0-i);
+        attributesAndCoefficients.push_back({std::make_tuple(i*.3, 2.0, .4), std::make_tuple((i%3)*1.0, 1.0, -.7)});
+    }
+    auto prepared=shazard::preparePortfolio(timeOnBooks, timeRemaining, attributesAndCoefficients);
+    Portfolio portfolio=Portfolio::fromTuples(timeOnBooks, timeRemaining, attributesAndCoefficients);
+    auto linearPredictors=portfolio.linearPredictors();
+    for(int i=0; i<20; ++i){
+        const auto& loan=prepared[i];
+        REQUIRE(loan.linearPredictor==shazard::linearPredictor(attributesAndCoefficients[i]));
+        REQUIRE(loan.timeOnBooks==timeOnBooks[i]);
+        REQUIRE(loan.timeRemaining==timeRemaining[i]);
+        auto fromPortfolio=shazard::prepareLoan(portfolio, i, linearPredictors);
+        REQUIRE(std::abs(fromPortfolio.linearPredictor-loan.linearPredictor)<1e-14);
+        REQUIRE(fromPortfolio.timeOnBooks==loan.timeOnBooks);
+        for(double horizon:{1.0, 12.0, 30.0}){
+            REQUIRE(shazard::PD(loan.timeOnBooks+horizon, loan.timeOnBooks, 1.2, loan.linearPredictor, surv)==shazard::PD(timeOnBooks[i]+horizon, timeOnBooks[i], 1.2, attributesAndCoefficients[i], surv));
+        }
+        REQUIRE(shazard::simulatedTimeToDefault(loan, surv, 1.2, .3)==shazard::simulatedTimeToDefault(timeOnBooks[i], timeRemaining[i], attributesAndCoefficients[i], surv, 1.2, .3));
+    }
+}
+TEST_CASE("Test ConditionalSurvival", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    for(double offset=-3; offset<=3; offset+=1.5){
+        double timeOnBooks=6;
+        shazard::ConditionalSurvival<Probit, shazard::Spline> probit(spline, timeOnBooks, offset, 1.5);
+        shazard::ConditionalSurvival<Hazard, shazard::Spline> hazard(spline, timeOnBooks, offset, 1.5);
+        shazard::ConditionalSurvival<Odds, shazard::Spline> odds(spline, timeOnBooks, offset, 1.5);
+        auto g=[&](double time){
+            return spline(log(time))+offset+log(1.5);
+        };
+        std::vector<double> horizons={7.0, 12.0, 24.0, 60.0};
+        auto pds=probit.PD(horizons);
+        for(int i=0; i<(int)horizons.size(); ++i){
+            double time=horizons[i];
+            double expectedProbit=erfc(g(time)*isqrt2)/erfc(g(timeOnBooks)*isqrt2);
+            double expectedHazard=exp(exp(g(timeOnBooks))-exp(g(time)));
+            double expectedOdds=(exp(g(timeOnBooks))+1)/(exp(g(time))+1);
+            REQUIRE(std::abs(probit(time)/expectedProbit-1)<1e-14);
+            REQUIRE(std::abs(hazard(time)/expectedHazard-1)<1e-13);
+            REQUIRE(std::abs(odds(time)/expectedOdds-1)<1e-14);
+            REQUIRE(pds[i]==probit.PD(time));
+        }
+    }
+}
+struct CountingSpline{
+    const shazard::Spline& spline;
+    mutable int evaluations;
+    double operator()(double x) const{
+        ++evaluations;
+        return spline(x);
+    }
+    double derivative(double x) const{
+        ++evaluations;
+        return spline.derivative(x);
+    }
+};
+TEST_CASE("Test simulatedTimeToDefaultInverse", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    CountingSpline counting{spline, 0};
+    double timeRemaining=120;
+    int numDraws=0;
+    int totalEvaluations=0;
+    int maxEvaluations=0;
+    for(double timeOnBooks=0; timeOnBooks<48; timeOnBooks+=5){
+        for(double offset=-2; offset<=2; offset+=.5){
+            shazard::ConditionalSurvival<Odds, CountingSpline> survival(counting, timeOnBooks, offset, 1.0);
+            for(double unif=.0001; unif<1; unif+=.0173){
+                counting.evaluations=0;
+                double timeToDefault=shazard::simulatedTimeToDefaultInverse(survival, timeRemaining, unif);
+                if(timeToDefault>timeRemaining){
+                    continue;
+                }
+                ++numDraws;
+                totalEvaluations+=counting.evaluations;
+                maxEvaluations=std::max(maxEvaluations, counting.evaluations);
+                double lo=0, hi=timeRemaining;
+                for(int i=0; i<200; ++i){
+                    double mid=.5*(lo+hi);
+                    if(survival.PD(timeOnBooks+mid)<unif){
+                        lo=mid;
+                    }
+                    else{
+                        hi=mid;
+                    }
+                }
+                REQUIRE(std::abs(timeToDefault-.5*(lo+hi))<1e-9*(1+timeToDefault));
+            }
+        }
+    }
+    REQUIRE(numDraws>1000);
+    REQUIRE((double)totalEvaluations/numDraws<10);//about 3 Newton steps of two evaluations, plus the bracket
+    REQUIRE(maxEvaluations<=24);
+}
+TEST_CASE("Test simulatePortfolioLosses", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    auto portfolio=testPortfolio(3000);
+    RCounter rng(7);
+    int n=50;
+    int scenario=0;
+    auto frailty=[&](){return .5+(scenario++%5)*.25;};
+    auto severity=[](int loan, double timeOnBooks, int scenario){return 100.0+loan%10-timeOnBooks;};
+    auto losses=shazard::simulatePortfolioLosses<Odds>(n, portfolio, frailty, rng, spline, severity, 36);
+    scenario=0;
+    auto defaultTimes=shazard::simulatePortfolio<Odds>(n, portfolio, frailty, rng, spline);
+    REQUIRE(losses.losses.size()==n);
+    for(int s=0; s<n; ++s){
+        double expected=0;
+        int numDefaults=0;
+        for(int i=0; i<portfolio.size(); ++i){
+            if(defaultTimes[s][i]<=36){
+                expected+=severity(i, portfolio.getTimeOnBooks(i)+defaultTimes[s][i], s);
+                ++numDefaults;
+            }
+        }
+        REQUIRE(losses.numDefaults[s]==numDefaults);
+        REQUIRE(std::abs(losses.losses[s]-expected)<1e-8*expected);
+        double byMonth=0;
+        for(double monthLoss:losses.lossByMonth[s]){
+            byMonth+=monthLoss;
+        }
+        REQUIRE(std::abs(byMonth-expected)<1e-8*expected);
+    }
+    WorkStealingPool singleThread(1);
+    scenario=0;
+    auto serial=shazard::simulatePortfolioLossesTiled(n, portfolio, frailty, shazard::counterLoanSimulator<Odds>(spline, rng), severity, 0, singleThread);
+    REQUIRE(serial.losses==losses.losses);
+    REQUIRE(serial.lossByMonth.empty());
+}
+TEST_CASE("Test checkpoint and resume", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    auto portfolio=testPortfolio(2000);
+    RCounter rng(11);
+    int n=40;
+    std::string checkpointFile=tempPath("checkpoint.bin");
+    std::remove(checkpointFile.c_str());
+    std::atomic<int> maxScenario(-1);
+    auto severity=[&](int loan, double timeOnBooks, int scenario){
+        int seen=maxScenario;
+        while(scenario>seen&&!maxScenario.compare_exchange_weak(seen, scenario)){}
+        return 50.0+loan%3;
+    };
+    GammaFrailty uninterruptedFrailty(.5, 0.0, 3);
+    auto uninterrupted=shazard::simulatePortfolioLosses<Odds>(n, portfolio, [&](){return uninterruptedFrailty.simulate();}, rng, spline, severity, 12);
+    GammaFrailty firstFrailty(.5, 0.0, 3);
+    auto first=shazard::simulatePortfolioLosses<Odds>(n, portfolio, [&](){return firstFrailty.simulate();}, rng, spline, severity, 12, checkpointFile, 15);
+    REQUIRE(first.losses==uninterrupted.losses);
+    shazard::RunMetadata metadata;
+    shazard::ScenarioLosses stored;
+    REQUIRE(shazard::readLosses(checkpointFile, metadata, stored));
+    REQUIRE(metadata.completedScenarios==n);
+    REQUIRE(stored.lossByMonth==uninterrupted.lossByMonth);
+    metadata.completedScenarios=30;//as if the run stopped after the second checkpoint
+    REQUIRE(shazard::writeLosses(checkpointFile, metadata, stored));
+    maxScenario=-1;
+    GammaFrailty resumedFrailty(.5, 0.0, 3);
+    int minScenario=n;
+    auto resumed=shazard::simulatePortfolioLosses<Odds>(n, portfolio, [&](){return resumedFrailty.simulate();}, rng, spline, [&](int loan, double timeOnBooks, int scenario){
+        if(scenario<30){
+            minScenario=scenario;
+        }
+        return severity(loan, timeOnBooks, scenario);
+    }, 12, checkpointFile, 15);
+    REQUIRE(minScenario==n);
+    REQUIRE(resumed.losses==uninterrupted.losses);
+    REQUIRE(resumed.numDefaults==uninterrupted.numDefaults);
+    REQUIRE(resumed.lossByMonth==uninterrupted.lossByMonth);
+    std::string bytes;
+    {
+        std::ifstream file(checkpointFile, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream file(checkpointFile, std::ios::binary|std::ios::trunc);
+        file.write(bytes.data(), bytes.size()-1);//as if the last append was cut short
+    }
+    REQUIRE(shazard::readLosses(checkpointFile, metadata, stored));
+    REQUIRE(metadata.completedScenarios==30);
+    REQUIRE(stored.losses.size()==30);
+    auto rerunScenarios=[&](uint64_t runId, const Portfolio& runPortfolio){
+        GammaFrailty runFrailty(.5, 0.0, 3);
+        int rerun=0;
+        shazard::simulatePortfolioLosses<Odds>(n, runPortfolio, [&](){return runFrailty.simulate();}, rng, spline, [&](int loan, double timeOnBooks, int scenario){
+            if(scenario==0){
+                rerun=1;
+            }
+            return 50.0+loan%3;
+        }, 12, checkpointFile, 15, runId);
+        return rerun;
+    };
+    REQUIRE(rerunScenarios(0, portfolio)==0);
+    REQUIRE(shazard::readLosses(checkpointFile, metadata, stored));
+    REQUIRE(metadata.completedScenarios==n);
+    REQUIRE(stored.losses==uninterrupted.losses);
+    REQUIRE(rerunScenarios(1, portfolio)==1);
+    Portfolio otherPortfolio(portfolio);
+    otherPortfolio.setCoefficients({.7});
+    REQUIRE(rerunScenarios(1, otherPortfolio)==1);
+    std::remove(checkpointFile.c_str());
+    GammaFrailty failedFrailty(.5, 0.0, 3);
+    REQUIRE_THROWS_AS(shazard::simulatePortfolioLosses<Odds>(n, portfolio, [&](){return failedFrailty.simulate();}, rng, spline, severity, 12, tempPath("missingDirectory/checkpoint.bin"), 15), const std::runtime_error&);
+}
+TEST_CASE("Test ExactSum", "[SHazard]"){
+    for(double scale:{1e-9, 1.0, 1e9}){
+        std::vector<double> values;
+        for(int i=0; i<1000; ++i){
+            values.emplace_back(scale*(1+i%17)/(3+i%5)*(i%11==0?-1:1));
+        }
+        shazard::ExactSum forward, backward, firstHalf, secondHalf;
+        long double expected=0;
+        for(int i=0; i<(int)values.size(); ++i){
+            forward.add(values[i]);
+            backward.add(values[values.size()-1-i]);
+            (i%2?secondHalf:firstHalf).add(values[i]);
+            expected+=values[i];
+        }
+        firstHalf.add(secondHalf);
+        REQUIRE(forward.toDouble()==backward.toDouble());
+        REQUIRE(forward.toDouble()==firstHalf.toDouble());
+        REQUIRE(std::abs(forward.toDouble()/(double)expected-1)<1e-14);
+    }
+    shazard::ExactSum cancel;
+    cancel.add(1e20);
+    cancel.add(3e-20);
+    cancel.add(-1e20);
+    REQUIRE(cancel.toDouble()==3e-20);
+    for(double sign:{1.0, -1.0}){
+        shazard::ExactSum rounding;//a tie at 2^-53 broken upwards by a far smaller term
+        rounding.add(sign);
+        rounding.add(sign*std::ldexp(1.0, -53));
+        rounding.add(sign*std::ldexp(1.0, -200));
+        REQUIRE(rounding.toDouble()==sign*(1+std::ldexp(1.0, -52)));
+        shazard::ExactSum tie;
+        tie.add(sign);
+        tie.add(sign*std::ldexp(1.0, -53));
+        REQUIRE(tie.toDouble()==sign);//ties to even
+    }
+    std::mt19937_64 generator(3);
+    std::uniform_real_distribution<double> mantissa(-1, 1);
+    std::uniform_int_distribution<int> exponent(-150, 150);
+    for(int i=0; i<10000; ++i){
+        const double a=std::ldexp(mantissa(generator), exponent(generator));
+        const double b=std::ldexp(mantissa(generator), exponent(generator)%60);
+        shazard::ExactSum pair;
+        pair.add(a);
+        pair.add(b);
+        REQUIRE(pair.toDouble()==a+b);//a double addition is correctly rounded
+    }
+}
+TEST_CASE("Test shards", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    auto portfolio=testPortfolio(1500);
+    RCounter rng(5);
+    int n=37;
+    auto severity=[](int loan, double timeOnBooks, int scenario){return 10.0+loan%13*.7-timeOnBooks*.01;};
+    const std::string singleFile=tempPath("single.bin");
+    std::vector<std::string> partialFiles={tempPath("shard2.bin"), tempPath("shard0.bin"), tempPath("shard1.bin")};
+    for(int shard=0; shard<3; ++shard){
+        std::string partialFile=tempPath("shard"+std::to_string(shard)+".bin");
+        std::remove(partialFile.c_str());
+        GammaFrailty frailty(.5, 0.0, 9);
+        auto shardLosses=shazard::simulatePortfolioLossesShard<Odds>(shard, 3, n, portfolio, [&](){return frailty.simulate();}, rng, spline, severity, 6, true, partialFile, 5);
+        int first, last;
+        shazard::shardRange(shard, 3, n, first, last);
+        REQUIRE(shardLosses.losses.size()==last-first);
+    }
+    std::remove(singleFile.c_str());
+    GammaFrailty frailty(.5, 0.0, 9);
+    shazard::simulatePortfolioLossesShard<Odds>(0, 1, n, portfolio, [&](){return frailty.simulate();}, rng, spline, severity, 6, true, singleFile, 100);
+    shazard::RunMetadata metadata, singleMetadata;
+    shazard::ScenarioLosses merged, single;
+    shazard::LoanAccumulators mergedAccumulators, singleAccumulators;
+    REQUIRE(shazard::mergeLosses(partialFiles, metadata, merged, &mergedAccumulators));
+    REQUIRE(!shazard::mergeLosses({partialFiles[1], partialFiles[0]}, metadata, merged));
+    REQUIRE(shazard::mergeLosses(partialFiles, metadata, merged, &mergedAccumulators));
+    REQUIRE(shazard::readLosses(singleFile, singleMetadata, single, &singleAccumulators));
+    REQUIRE(merged.losses==single.losses);
+    REQUIRE(merged.lossByMonth==single.lossByMonth);
+    REQUIRE(mergedAccumulators.getLoss()==singleAccumulators.getLoss());
+    REQUIRE(mergedAccumulators.getLossTimesPortfolio()==singleAccumulators.getLossTimesPortfolio());
+    GammaFrailty directFrailty(.5, 0.0, 9);
+    auto defaultTimes=shazard::simulatePortfolio<Odds>(n, portfolio, [&](){return directFrailty.simulate();}, rng, spline);
+    double loss=0, lossTimesPortfolio=0;
+    for(int s=0; s<n; ++s){
+        if(defaultTimes[s][3]<=36){
+            double loanLoss=severity(3, portfolio.getTimeOnBooks(3)+defaultTimes[s][3], s);
+            loss+=loanLoss;
+            lossTimesPortfolio+=loanLoss*single.losses[s];
+        }
+    }
+    REQUIRE(std::abs(mergedAccumulators.getLoss()[3]/loss-1)<1e-12);
+    REQUIRE(std::abs(mergedAccumulators.getLossTimesPortfolio()[3]/lossTimesPortfolio-1)<1e-9);
+    int numLoans=portfolio.size();
+    std::vector<double> exloss(numLoans, 0.0), cov(numLoans, 0.0);
+    for(int s=0; s<n; ++s){
+        for(int i=0; i<numLoans; ++i){
+            if(defaultTimes[s][i]<=36){
+                double loanLoss=severity(i, portfolio.getTimeOnBooks(i)+defaultTimes[s][i], s);
+                exloss[i]+=loanLoss;
+                cov[i]+=loanLoss*single.losses[s]/n;
+            }
+        }
+    }
+    RiskContribution<Upper> rc(single.losses);
+    double portfolioExLoss=std::accumulate(single.losses.begin(), single.losses.end(), 0.0)/n;
+    double sumSquares=0;
+    for(double scenarioLoss:single.losses){
+        sumSquares+=(scenarioLoss-portfolioExLoss)*(scenarioLoss-portfolioExLoss);
+    }
+    double portfolioVariance=sumSquares/(n-1);
+    double VaR=rc.getVaR(.9);
+    auto expected=rc.getRCCov(std::move(cov), exloss, portfolioExLoss, portfolioVariance, VaR);
+    auto mergedCov=mergedAccumulators.getLossTimesPortfolio();
+    for(auto& value:mergedCov){
+        value/=n;
+    }
+    auto contributions=rc.getRCCov(std::move(mergedCov), mergedAccumulators.getLoss(), portfolioExLoss, portfolioVariance, VaR);
+    double total=0;
+    for(int i=0; i<numLoans; ++i){
+        REQUIRE(std::abs(contributions[i]-expected[i])<1e-9*std::max(1.0, std::abs(expected[i])));
+        total+=contributions[i];
+    }
+    REQUIRE(std::abs(total/VaR-1)<1e-6);
+    std::string bytes;
+    {
+        std::ifstream file(singleFile, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    const size_t headerOffset=2*sizeof(uint32_t);
+    {
+        std::ifstream file(partialFiles[1], std::ios::binary|std::ios::ate);
+        const size_t scenarioBytes=sizeof(double)+sizeof(int)+6*sizeof(double);
+        const size_t accumulatorBytes=2*numLoans*sizeof(shazard::ExactSum);
+        REQUIRE((size_t)file.tellg()==headerOffset+sizeof(shazard::RunMetadata)+sizeof(uint64_t)+12*scenarioBytes+accumulatorBytes);//three checkpoints leave one copy of the accumulators
+    }
+    auto corruptField=[&](size_t offset, int32_t value){
+        std::string corrupt(bytes);
+        std::memcpy(&corrupt[headerOffset+offset], &value, sizeof(value));
+        std::ofstream file(partialFiles[2], std::ios::binary|std::ios::trunc);
+        file.write(corrupt.data(), corrupt.size());
+    };
+    shazard::RunMetadata corruptMetadata;
+    shazard::ScenarioLosses corruptLosses;
+    shazard::LoanAccumulators corruptAccumulators;
+    for(auto field:{std::make_pair(offsetof(shazard::RunMetadata, numMonths), 1<<30), std::make_pair(offsetof(shazard::RunMetadata, numMonths), -1), std::make_pair(offsetof(shazard::RunMetadata, numLoans), -5), std::make_pair(offsetof(shazard::RunMetadata, numLoans), 1<<30), std::make_pair(offsetof(shazard::RunMetadata, completedScenarios), n+1), std::make_pair(offsetof(shazard::RunMetadata, lastScenario), -1)}){
+        corruptField(field.first, field.second);
+        REQUIRE(!shazard::readLosses(partialFiles[2], corruptMetadata, corruptLosses, &corruptAccumulators));
+        REQUIRE(!shazard::mergeLosses(partialFiles, corruptMetadata, corruptLosses, &corruptAccumulators));
+    }
+    {
+        std::ofstream file(partialFiles[2], std::ios::binary|std::ios::trunc);
+        file.write(bytes.data(), bytes.size()-1);
+    }
+    REQUIRE(!shazard::readLosses(partialFiles[2], corruptMetadata, corruptLosses, &corruptAccumulators));//loan accumulators are never appended, so nothing can be dropped
+    REQUIRE(!shazard::mergeLosses({partialFiles[2]}, corruptMetadata, corruptLosses, &corruptAccumulators));
+    {
+        std::ofstream file(partialFiles[2], std::ios::binary|std::ios::trunc);
+        file.write(bytes.data(), headerOffset+sizeof(shazard::RunMetadata));
+    }
+    corruptLosses=shazard::ScenarioLosses();
+    REQUIRE(!shazard::readLosses(partialFiles[2], corruptMetadata, corruptLosses, &corruptAccumulators));
+    REQUIRE(corruptLosses.losses.empty());
+    for(const auto& partialFile:partialFiles){
+        std::remove(partialFile.c_str());
+    }
+    std::remove(singleFile.c_str());
+}
+TEST_CASE("Test tail contributions", "[SHazard]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    auto portfolio=testPortfolio(500);
+    RCounter rng(13);
+    int n=600;
+    double q=.97;
+    auto severity=[](int loan, double timeOnBooks, int scenario){return 20.0+loan%11;};
+    shazard::TailContributions tail(portfolio.size(), shazard::TailContributions::tailSizeFor(n, q));
+    GammaFrailty frailty(.5, 0.0, 4);
+    auto losses=shazard::simulatePortfolioLosses<Odds>(n, portfolio, [&](){return frailty.simulate();}, rng, spline, severity, 0, tail);
+    REQUIRE(tail.getScenarios().size()==18);
+    RiskContribution<Upper> rc(losses.losses);
+    REQUIRE(std::abs(tail.getEShortfall()-rc.getEShortfall(q))<1e-9*tail.getEShortfall());
+    GammaFrailty directFrailty(.5, 0.0, 4);
+    auto defaultTimes=shazard::simulatePortfolio<Odds>(n, portfolio, [&](){return directFrailty.simulate();}, rng, spline);
+    auto contributions=tail.getContributions();
+    double total=0;
+    for(int i=0; i<portfolio.size(); ++i){
+        double expected=0;
+        for(int s:tail.getScenarios()){
+            if(defaultTimes[s][i]<=36){
+                expected+=severity(i, 0, s);
+            }
+        }
+        REQUIRE(std::abs(contributions[i]-expected/18)<1e-12);
+        total+=contributions[i];
+    }
+    REQUIRE(std::abs(total-tail.getEShortfall())<1e-9*total);
+    shazard::TailContributions firstHalf(portfolio.size(), 18), secondHalf(portfolio.size(), 18);
+    for(int s=0; s<n; ++s){
+        std::vector<std::pair<int, double> > loanLosses;
+        for(int i=0; i<portfolio.size(); ++i){
+            if(defaultTimes[s][i]<=36){
+                loanLosses.emplace_back(i, severity(i, 0, s));
+            }
+        }
+        (s%2?secondHalf:firstHalf).add(losses.losses[s], s, loanLosses);
+    }
+    secondHalf.merge(firstHalf);
+    REQUIRE(secondHalf.getScenarios()==tail.getScenarios());
+    REQUIRE(secondHalf.getContributions()==contributions);
+    REQUIRE_THROWS_AS(shazard::TailContributions(portfolio.size(), shazard::TailContributions::tailSizeFor(n, 1.0)), const std::invalid_argument&);
+}
+TEST_CASE("Test gammaQuadrature", "[LossDistribution]"){
+    for(double variance:{.1, .5, 2.0}){
+        std::vector<double> nodes, weights;
+        LossDistribution<Odds, shazard::Spline>::gammaQuadrature(variance, 20, nodes, weights);
+        double sum=0, mean=0, secondMoment=0;
+        for(int i=0; i<20; ++i){
+            sum+=weights[i];
+            mean+=weights[i]*nodes[i];
+            secondMoment+=weights[i]*nodes[i]*nodes[i];
+        }
+        REQUIRE(std::abs(sum-1)<1e-10);
+        REQUIRE(std::abs(mean-1)<1e-10);
+        REQUIRE(std::abs(secondMoment-1-variance)<1e-9);
+    }
+}
+TEST_CASE("Test conditional loss distribution", "[LossDistribution]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    Portfolio portfolio(1);
+    portfolio.addLoan(6, 24, {1.0});
+    portfolio.addLoan(12, 6, {0.0});
+    portfolio.addLoan(0, 36, {2.0});
+    portfolio.setCoefficients({.5});
+    std::vector<double> severities={2.0, 1.0, 1.5};
+    double frailty=1.3;
+    LossDistribution<Odds, shazard::Spline> distribution(portfolio, spline, 12, severities, 1.0, {frailty}, {1.0});
+    std::vector<double> pds;
+    auto linearPredictors=portfolio.linearPredictors();
+    double expectedLoss=0;
+    for(int i=0; i<3; ++i){
+        auto loan=shazard::prepareLoan(portfolio, i, linearPredictors);
+        pds.push_back(shazard::makeConditionalSurvival<Odds>(spline, loan, frailty).PD(loan.timeOnBooks+std::min(12.0, loan.timeRemaining)));
+        expectedLoss+=pds.back()*severities[i];
+    }
+    const auto& probabilities=distribution.getProbabilities();
+    REQUIRE(std::abs(probabilities[0]-(1-pds[0])*(1-pds[1])*(1-pds[2]))<1e-14);
+    REQUIRE(std::abs(probabilities.back()-pds[0]*pds[1]*.5*pds[2])<1e-14);
+    REQUIRE(std::abs(distribution.getExpectedLoss()-expectedLoss)<1e-12);
+    double total=0;
+    for(double probability:probabilities){
+        total+=probability;
+    }
+    REQUIRE(std::abs(total-1)<1e-14);
+}
+TEST_CASE("Test capped loss distribution", "[LossDistribution]"){
+    auto knots_gamma=testKnots();
+    shazard::Spline spline(knots_gamma);
+    int numLoans=2000;
+    Portfolio portfolio(1);
+    std::vector<double> severities(numLoans);
+    for(int i=0; i<numLoans; ++i){
+        portfolio.addLoan(i%24, 12+i%36, {(i%7)/7.0});
+        severities[i]=1.0+(i%5)*.7;
+    }
+    portfolio.setCoefficients({-2.0});
+    std::vector<double> nodes, weights;
+    LossDistribution<Odds, shazard::Spline>::gammaQuadrature(.5, 20, nodes, weights);
+    LossDistribution<Odds, shazard::Spline> uncapped(portfolio, spline, 12, severities, 1.0, nodes, weights, 1<<30);
+    int maxPoints=1024;
+    LossDistribution<Odds, shazard::Spline> capped(portfolio, spline, 12, severities, 1.0, nodes, weights, maxPoints);
+    REQUIRE(uncapped.getTailProbability()==0);
+    REQUIRE((int)uncapped.getProbabilities().size()>maxPoints);
+    REQUIRE((int)capped.getProbabilities().size()==maxPoints);
+    REQUIRE(capped.getTailProbability()>0);
+    double uncappedTail=0;
+    for(int k=0; k<(int)uncapped.getProbabilities().size(); ++k){
+        if(k<maxPoints){
+            REQUIRE(std::abs(capped.getProbabilities()[k]-uncapped.getProbabilities()[k])<1e-14);
+        }
+        else{
+            uncappedTail+=uncapped.getProbabilities()[k];
+        }
+    }
+    REQUIRE(std::abs(capped.getTailProbability()-uncappedTail)<1e-12);
+    REQUIRE(uncappedTail>1e-3);
+    REQUIRE(uncappedTail<1e-2);
+    REQUIRE(std::abs(capped.getExpectedLoss()/uncapped.getExpectedLoss()-1)<1e-10);
+    double q=1-2*uncappedTail;
+    REQUIRE(capped.getVaR(q)==uncapped.getVaR(q));
+    REQUIRE(std::abs(capped.getEShortfall(q)/uncapped.getEShortfall(q)-1)<1e-10);
+    REQUIRE_THROWS_AS(capped.getVaR(1-uncappedTail/2), const std::out_of_range&);
+    REQUIRE_THROWS_AS(capped.getEShortfall(1-uncappedTail/2), const std::out_of_range&);
 }
 TEST_CASE("Test sort_indexes", "[RiskContribution]"){
     std::vector<double> testIndexu={4.0, 3.0, 5.0, 8.0, 1.0};
@@ -99,6 +1014,318 @@ TEST_CASE("Test sort_indexes", "[RiskContribution]"){
     REQUIRE(rcl.getVaR(.99)==1.0);
 
     
+}
+TEST_CASE("Test radix_sort_indexes", "[RiskContribution]"){
+    std::vector<double> values(300000);
+    RNorm(2).fill(values.data(), values.size());
+    values[5]=0.0;
+    values[6]=-0.0;
+    values[7]=values[100];
+    values[8]=-1e300;
+    values[9]=1e-310;
+    RiskContribution<Upper> rcu(values, true);
+    RiskContribution<Lower> rcl(values, true);
+    auto isOrdered=[&](const std::vector<size_t>& idx, bool isAscending){
+        for(size_t i=1; i<idx.size(); ++i){
+            double previous=values[idx[i-1]];
+            double current=values[idx[i]];
+            if(isAscending?previous>current:previous<current){
+                return false;
+            }
+            if(previous==current&&idx[i-1]>idx[i]){
+                return false;
+            }
+        }
+        return true;
+    };
+    for(int numThreads:{1, 3, 8}){
+        WorkStealingPool pool(numThreads);
+        auto ascending=rcu.radix_sort_indexes(values, pool);
+        REQUIRE(isOrdered(ascending, true));
+        REQUIRE(ascending.front()==8);
+        auto descending=rcl.radix_sort_indexes(values, pool);
+        REQUIRE(isOrdered(descending, false));
+        REQUIRE(descending.back()==8);
+    }
+    WorkStealingPool twoThreads(2);
+    REQUIRE(rcu.sort_indexes(values)==rcu.radix_sort_indexes(values));
+    REQUIRE(rcu.comparison_sort_indexes(values)==rcu.radix_sort_indexes(values));
+    REQUIRE(rcl.comparison_sort_indexes(values)==rcl.radix_sort_indexes(values));
+    std::vector<double> ties={2.0, -0.0, 1.0, 0.0, 2.0, -0.0, 1.0};
+    REQUIRE(rcu.comparison_sort_indexes(ties)==std::vector<size_t>({1, 3, 5, 2, 6, 0, 4}));
+    REQUIRE(rcu.radix_sort_indexes(ties, twoThreads)==rcu.comparison_sort_indexes(ties));
+    REQUIRE(rcl.radix_sort_indexes(ties, twoThreads)==rcl.comparison_sort_indexes(ties));
+    std::vector<double> small={4.0, 3.0, 5.0, 8.0, 1.0};
+    std::vector<size_t> expected={4, 1, 0, 2, 3};
+    REQUIRE(rcu.radix_sort_indexes(small, twoThreads)==expected);
+    RiskContribution<Upper> eager(values);
+    REQUIRE(eager.getVaR(.99)==rcu.getVaR(.99));
+}
+TEST_CASE("Test lazy VaR and ES", "[RiskContribution]"){
+    RNorm rnorm(8);
+    std::vector<double> losses(10001);
+    rnorm.fill(losses.data(), losses.size());
+    RiskContribution<Upper> eager(losses);
+    RiskContribution<Upper> lazy(losses, true);
+    RiskContribution<Lower> eagerLower(losses);
+    RiskContribution<Lower> lazyLower(losses, true);
+    for(double q:{.99, .5, .999, .9}){
+        REQUIRE(lazy.getVaR(q)==eager.getVaR(q));
+        REQUIRE(std::abs(lazy.getEShortfall(q)-eager.getEShortfall(q))<1e-12);
+        REQUIRE(lazyLower.getVaR(q)==eagerLower.getVaR(q));
+        REQUIRE(std::abs(lazyLower.getEShortfall(q)-eagerLower.getEShortfall(q))<1e-12);
+    }
+    std::vector<double> weights(losses.size(), 1.0);
+    REQUIRE(lazy.getVaR(.95, weights)==eager.getVaR(.95, weights));
+}
+TEST_CASE("Test getTailMetrics", "[RiskContribution]"){
+    RNorm rnorm(9);
+    std::vector<double> losses(20000);
+    rnorm.fill(losses.data(), losses.size());
+    std::vector<double> qs={.99, .9, .9997, .95, .995, .999};
+    RiskContribution<Upper> eager(losses);
+    RiskContribution<Lower> lazy(losses, true);
+    RiskContribution<Lower> lazyReference(losses, true);
+    auto metrics=eager.getTailMetrics(qs);
+    auto lazyMetrics=lazy.getTailMetrics(qs);
+    for(int i=0; i<(int)qs.size(); ++i){
+        REQUIRE(metrics.VaR[i]==eager.getVaR(qs[i]));
+        REQUIRE(std::abs(metrics.eShortfall[i]-eager.getEShortfall(qs[i]))<1e-12);
+        REQUIRE(lazyMetrics.VaR[i]==lazyReference.getVaR(qs[i]));
+        REQUIRE(std::abs(lazyMetrics.eShortfall[i]-lazyReference.getEShortfall(qs[i]))<1e-12);
+    }
+}
+TEST_CASE("Test weighted VaR and ES", "[RiskContribution]"){
+    std::vector<double> losses={4.0, 3.0, 5.0, 8.0, 1.0};
+    RiskContribution<Upper> rc(losses);
+    std::vector<double> equalWeights(5, 1.0);
+    REQUIRE(rc.getVaR(.6, equalWeights)==rc.getVaR(.6));
+    REQUIRE(rc.getEShortfall(.6, equalWeights)==rc.getEShortfall(.6));
+    std::vector<double> weights={1.0, 1.0, .5, .25, 2.0};
+    REQUIRE(rc.getVaR(.9, weights)==5.0);
+    REQUIRE(std::abs(rc.getEShortfall(.9, weights)-(.25*8.0+.25*5.0)/.5)<1e-12);
+}
+TEST_CASE("Test getRCCov", "[RiskContribution]"){
+    int m=2000;
+    int numLoans=3;
+    std::vector<std::vector<double> > loanLosses(m, std::vector<double>(numLoans));
+    std::vector<double> losses(m, 0.0);
+    std::vector<double> norms(m*numLoans);
+    RNorm(8).fill(norms.data(), norms.size());
+    for(int s=0; s<m; ++s){
+        for(int i=0; i<numLoans; ++i){
+            loanLosses[s][i]=std::max(0.0, norms[s*numLoans+i]+norms[s*numLoans]*.5*i);
+            losses[s]+=loanLosses[s][i];
+        }
+    }
+    std::vector<double> weights(m);
+    RUnif(8).fill(weights.data(), m);
+    for(auto& weight:weights){
+        weight*=2;
+    }
+    auto check=[&](const std::vector<double>& scenarioWeights, double VaR){
+        double totalWeight=std::accumulate(scenarioWeights.begin(), scenarioWeights.end(), 0.0);
+        std::vector<double> exloss(numLoans, 0.0), cov(numLoans, 0.0);
+        double portfolioExLoss=0;
+        for(int s=0; s<m; ++s){
+            portfolioExLoss+=scenarioWeights[s]*losses[s]/totalWeight;
+            for(int i=0; i<numLoans; ++i){
+                exloss[i]+=scenarioWeights[s]*loanLosses[s][i];
+                cov[i]+=scenarioWeights[s]*loanLosses[s][i]*losses[s]/totalWeight;
+            }
+        }
+        double portfolioVariance=0;
+        std::vector<double> covariance(numLoans, 0.0);
+        for(int s=0; s<m; ++s){
+            portfolioVariance+=scenarioWeights[s]*(losses[s]-portfolioExLoss)*(losses[s]-portfolioExLoss)/(totalWeight-1);
+            for(int i=0; i<numLoans; ++i){
+                covariance[i]+=scenarioWeights[s]*(loanLosses[s][i]-exloss[i]/totalWeight)*(losses[s]-portfolioExLoss)/(totalWeight-1);
+            }
+        }
+        RiskContribution<Upper> rc(losses);
+        auto contributions=rc.getRCCov(std::vector<double>(cov), exloss, portfolioExLoss, portfolioVariance, VaR, scenarioWeights);
+        double total=0;
+        for(int i=0; i<numLoans; ++i){
+            double expected=exloss[i]/totalWeight+covariance[i]*(VaR-portfolioExLoss)/portfolioVariance;
+            REQUIRE(std::abs(contributions[i]-expected)<1e-10);
+            total+=contributions[i];
+        }
+        REQUIRE(std::abs(total-VaR)<1e-10);
+        return contributions;
+    };
+    RiskContribution<Upper> rc(losses);
+    double VaR=rc.getVaR(.99);
+    std::vector<double> unitWeights(m, 1.0);
+    auto unitContributions=check(unitWeights, VaR);
+    check(weights, rc.getVaR(.99, weights));
+    std::vector<double> exloss(numLoans, 0.0), cov(numLoans, 0.0);
+    double portfolioExLoss=0, sumSquares=0;
+    for(int s=0; s<m; ++s){
+        portfolioExLoss+=losses[s]/m;
+        sumSquares+=losses[s]*losses[s];
+        for(int i=0; i<numLoans; ++i){
+            exloss[i]+=loanLosses[s][i];
+            cov[i]+=loanLosses[s][i]*losses[s]/m;
+        }
+    }
+    double portfolioVariance=(sumSquares-m*portfolioExLoss*portfolioExLoss)/(m-1);
+    auto contributions=rc.getRCCov(std::move(cov), exloss, portfolioExLoss, portfolioVariance, VaR);
+    for(int i=0; i<numLoans; ++i){
+        REQUIRE(std::abs(contributions[i]-unitContributions[i])<1e-10);
+    }
+}
+TEST_CASE("Test importance sampling", "[GammaFrailty]"){
+    double variance=.5;
+    double q=.999;
+    int n=1000000;
+    GammaFrailty plain(variance, 0.0, 42);
+    std::vector<double> plainLosses(n);
+    for(auto& loss:plainLosses){
+        loss=plain.simulate();
+    }
+    REQUIRE(plain.getWeights()[10]==1.0);
+    RiskContribution<Upper> plainRc(plainLosses);
+    int nIS=100000;
+    GammaFrailty tilted(variance, GammaFrailty::tiltForMean(variance, 3.0), 42);
+    std::vector<double> tiltedLosses(nIS);
+    for(auto& loss:tiltedLosses){
+        loss=tilted.simulate();
+    }
+    double meanWeight=std::accumulate(tilted.getWeights().begin(), tilted.getWeights().end(), 0.0)/nIS;
+    REQUIRE(std::abs(meanWeight-1.0)<.05);
+    RiskContribution<Upper> tiltedRc(tiltedLosses);
+    REQUIRE(std::abs(tiltedRc.getVaR(q, tilted.getWeights())/plainRc.getVaR(q)-1)<.03);
+    REQUIRE(std::abs(tiltedRc.getEShortfall(q, tilted.getWeights())/plainRc.getEShortfall(q)-1)<.03);
+}
+TEST_CASE("Test gamma draws", "[GammaFrailty]"){
+    GammaFrailty golden(.5, 0.0, 3);
+    REQUIRE(std::abs(golden.simulate()-1.0884385033568666)<1e-12);
+    REQUIRE(std::abs(golden.simulate()-1.6771389280804572)<1e-12);
+    GammaFrailty goldenTilted(.5, GammaFrailty::tiltForMean(.5, 3.0), 3);
+    REQUIRE(std::abs(goldenTilted.simulate()-3.2653155100706011)<1e-12);
+    REQUIRE(std::abs(goldenTilted.getWeights()[0]-0.11572605957989032)<1e-12);
+    for(double variance:{.5, 2.0}){
+        GammaFrailty frailty(variance, 0.0, 7);
+        int n=1000000;
+        double sum=0, sumSq=0;
+        for(int i=0; i<n; ++i){
+            double draw=frailty.simulate();
+            REQUIRE(draw>0);
+            sum+=draw;
+            sumSq+=draw*draw;
+        }
+        double mean=sum/n;
+        REQUIRE(std::abs(mean-1.0)<.01);
+        REQUIRE(std::abs((sumSq/n-mean*mean)/variance-1.0)<.03);
+    }
+}
+TEST_CASE("Test getVaR and getEShortfall", "[QuantileSketch]"){
+    int n=200000;
+    std::vector<double> losses(n);
+    RNorm(4).fill(losses.data(), n);
+    RiskContribution<Upper> exact(losses);
+    RiskContribution<Lower> exactLower(losses);
+    QuantileSketch<Upper> sketch;
+    QuantileSketch<Lower> sketchLower;
+    std::vector<QuantileSketch<Upper> > shards(4);
+    for(int i=0; i<n; ++i){
+        sketch.add(losses[i]);
+        sketchLower.add(losses[i]);
+        shards[i%4].add(losses[i]);
+    }
+    for(int shard=1; shard<4; ++shard){
+        shards[0].merge(shards[shard]);
+    }
+    REQUIRE(sketch.size()==n);
+    REQUIRE(shards[0].size()==n);
+    REQUIRE(sketch.numRetained()<2000);
+    REQUIRE(sketch.getVaR(.999)==exact.getVaR(.999));
+    REQUIRE(std::abs(sketch.getEShortfall(.999)-exact.getEShortfall(.999))<1e-12);
+    REQUIRE(shards[0].getVaR(.999)==exact.getVaR(.999));
+    REQUIRE(sketchLower.getVaR(.999)==exactLower.getVaR(.999));
+    std::vector<double> sorted(losses);
+    std::sort(sorted.begin(), sorted.end());
+    auto rankOf=[&](double value){
+        return (double)(std::lower_bound(sorted.begin(), sorted.end(), value)-sorted.begin())/n;
+    };
+    for(double q:{.5, .9, .99}){
+        REQUIRE(std::abs(rankOf(sketch.getVaR(q))-q)<.01);
+        REQUIRE(std::abs(rankOf(shards[0].getVaR(q))-q)<.01);
+        REQUIRE(std::abs(sketch.getEShortfall(q)-exact.getEShortfall(q))<.02);
+    }
+    REQUIRE(std::abs(rankOf(sketchLower.getVaR(.9))-.1)<.01);
+    const std::string sketchFile=tempPath("sketch.bin");
+    REQUIRE(sketch.save(sketchFile));
+    QuantileSketch<Upper> loaded;
+    REQUIRE(loaded.load(sketchFile));
+    REQUIRE(loaded.getVaR(.9)==sketch.getVaR(.9));
+    REQUIRE(loaded.size()==n);
+    std::remove(sketchFile.c_str());
+}
+TEST_CASE("Test invalid sketches", "[QuantileSketch]"){
+    REQUIRE_THROWS_AS(QuantileSketch<Upper>(200, 0), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(QuantileSketch<Upper>(0, 1000), const std::invalid_argument&);
+    QuantileSketch<Upper> empty;
+    REQUIRE_THROWS_AS(empty.getVaR(.99), const std::logic_error&);
+    REQUIRE_THROWS_AS(empty.getEShortfall(.99), const std::logic_error&);
+    QuantileSketch<Upper> sketch(50, 100);
+    std::vector<double> losses(5000);
+    RNorm(6).fill(losses.data(), losses.size());
+    for(double loss:losses){
+        sketch.add(loss);
+    }
+    REQUIRE_THROWS_AS(sketch.getVaR(1.0), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(sketch.getEShortfall(-.1), const std::invalid_argument&);
+    QuantileSketch<Upper> otherK(60, 100), otherTail(50, 200);
+    otherK.add(1.0);
+    otherTail.add(1.0);
+    REQUIRE_THROWS_AS(sketch.merge(otherK), const std::invalid_argument&);
+    REQUIRE_THROWS_AS(sketch.merge(otherTail), const std::invalid_argument&);
+    REQUIRE(sketch.size()==5000);
+    const std::string sketchFile=tempPath("sketch.bin");
+    REQUIRE(sketch.save(sketchFile));
+    std::string bytes;
+    {
+        std::ifstream file(sketchFile, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    auto loadBytes=[&](const std::string& contents, QuantileSketch<Upper>& target){
+        {
+            std::ofstream file(sketchFile, std::ios::binary|std::ios::trunc);
+            file.write(contents.data(), contents.size());
+        }
+        return target.load(sketchFile);
+    };
+    QuantileSketch<Upper> loaded;
+    loaded.add(3.0);
+    REQUIRE(!loadBytes(bytes.substr(0, bytes.size()-8), loaded));
+    REQUIRE(!loadBytes(bytes+std::string(8, '\0'), loaded));
+    const size_t headerOffset=2*sizeof(uint32_t);
+    std::string corrupt(bytes);
+    const int hugeLength=1<<30;
+    std::memcpy(&corrupt[headerOffset+sizeof(int)*2+sizeof(long long)+sizeof(uint64_t)], &hugeLength, sizeof(hugeLength));
+    REQUIRE(!loadBytes(corrupt, loaded));
+    corrupt=bytes;
+    const long long wrongCount=4999;
+    std::memcpy(&corrupt[headerOffset+sizeof(int)*2], &wrongCount, sizeof(wrongCount));
+    REQUIRE(!loadBytes(corrupt, loaded));
+    corrupt=bytes;
+    const int zeroTail=0;
+    std::memcpy(&corrupt[headerOffset+sizeof(int)], &zeroTail, sizeof(zeroTail));
+    REQUIRE(!loadBytes(corrupt, loaded));
+    for(size_t offset:{(size_t)0, sizeof(uint32_t)}){//magic, then version
+        corrupt=bytes;
+        corrupt[offset]^=1;
+        REQUIRE(!loadBytes(corrupt, loaded));
+    }
+    REQUIRE(!loadBytes(bytes.substr(headerOffset), loaded));//a file without the header
+    REQUIRE(!loaded.load(tempPath("missingSketch.bin")));
+    REQUIRE(loaded.size()==1);
+    REQUIRE(loaded.getVaR(.5)==3.0);
+    REQUIRE(loadBytes(bytes, loaded));
+    REQUIRE(loaded.size()==5000);
+    REQUIRE(loaded.getVaR(.9)==sketch.getVaR(.9));
+    std::remove(sketchFile.c_str());
 }
 TEST_CASE("Test NodeCommunication", "[NodeCommunicate]"){
     std::streambuf *sbuf = std::cout.rdbuf();